@@ -0,0 +1,459 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * USB gadget launcher for the ufb daemon
+ *
+ * Does what linuxrc's shell loops used to do, without the sleeps: every
+ * UDC, present at start or showing up later (kernel uevent), gets a
+ * configfs gadget with a FunctionFS function, an ufb instance serving it,
+ * and is bound as soon as ufb tells it has written the descriptors: a
+ * byte on the pipe it gets as UFB_READY_FD. An ufb that doesn't know
+ * about the pipe is caught by looking for its endpoint files every
+ * READY_POLL_MS.
+ *
+ * Copyright (C) 2024 NXP
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <linux/netlink.h>
+
+#define UDC_DIR		"/sys/class/udc"
+#define GADGET_DIR	"/sys/kernel/config/usb_gadget"
+
+#define MAX_UDC		8
+
+/* how often unbound UDCs are checked for endpoint files */
+#define READY_POLL_MS	100
+
+struct udc {
+	char name[64];
+	char gadget[128];	/* configfs directory */
+	char ffs[32];		/* FunctionFS mount point */
+	int ready;		/* readiness pipe from ufb, -1 once bound */
+	pid_t pid;		/* ufb serving it */
+	int bound;
+};
+
+static struct udc udcs[MAX_UDC];
+static int udc_count;
+static const char *ufb = "ufb";
+static int product = 0x9BFF;
+static struct timespec start;
+
+static unsigned long elapsed_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - start.tv_sec) * 1000 +
+	       (ts.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+static int write_attr(const char *dir, const char *attr, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static int write_attr(const char *dir, const char *attr, const char *fmt, ...)
+{
+	char path[256], buf[128];
+	va_list ap;
+	int fd, len, ret;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		printf("can't open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	ret = write(fd, buf, len);
+	if (ret != len)
+		printf("can't write %s: %s\n", path, strerror(errno));
+	close(fd);
+	return ret == len ? 0 : -1;
+}
+
+static int make_dir(const char *dir, const char *sub)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, sub);
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		printf("can't create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* configfs resolves link targets like a path lookup, so keep them absolute */
+static int make_link(const char *dir, const char *target, const char *name)
+{
+	char from[256], to[256];
+
+	snprintf(to, sizeof(to), "%s/%s", dir, target);
+	snprintf(from, sizeof(from), "%s/%s", dir, name);
+	if (symlink(to, from) && errno != EEXIST) {
+		printf("can't link %s: %s\n", from, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void read_serial(char *serial, size_t size)
+{
+	int fd, len = 0;
+
+	fd = open("/sys/devices/soc0/soc_uid", O_RDONLY);
+	if (fd >= 0) {
+		len = read(fd, serial, size - 1);
+		close(fd);
+	}
+	if (len <= 0) {
+		snprintf(serial, size, "0000000000000000");
+		return;
+	}
+	while (len && (serial[len - 1] == '\n' || serial[len - 1] == ' '))
+		len--;
+	serial[len] = 0;
+}
+
+static int setup_gadget(struct udc *u, int id)
+{
+	char dir[192], serial[64], func[32], name[sizeof(u->name)];
+
+	/* a copy, snprintf mustn't read from the object it writes */
+	memcpy(name, u->name, sizeof(name));
+	snprintf(u->gadget, sizeof(u->gadget), GADGET_DIR "/%s", name);
+	if (mkdir(u->gadget, 0755) && errno != EEXIST) {
+		printf("can't create %s: %s\n", u->gadget, strerror(errno));
+		return -1;
+	}
+
+	if (write_attr(u->gadget, "idVendor", "0x066F") ||
+	    write_attr(u->gadget, "idProduct", "0x%04X", product))
+		return -1;
+
+	read_serial(serial, sizeof(serial));
+	snprintf(dir, sizeof(dir), "%s/strings/0x409", u->gadget);
+	if (make_dir(u->gadget, "strings/0x409") ||
+	    write_attr(dir, "serialnumber", "%s", serial) ||
+	    write_attr(dir, "product", "FSL i.MX Board"))
+		return -1;
+
+	snprintf(dir, sizeof(dir), "%s/configs/c.1", u->gadget);
+	if (make_dir(u->gadget, "configs/c.1") ||
+	    write_attr(dir, "MaxPower", "5"))
+		return -1;
+
+	snprintf(dir, sizeof(dir), "%s/os_desc", u->gadget);
+	if (write_attr(dir, "use", "1") ||
+	    write_attr(dir, "qw_sign", "MSFT100") ||
+	    write_attr(dir, "b_vendor_code", "0x40"))
+		return -1;
+
+	snprintf(func, sizeof(func), "functions/ffs.utp%d", id);
+	if (make_dir(u->gadget, func))
+		return -1;
+
+	snprintf(u->ffs, sizeof(u->ffs), "/dev/usb-utp%d", id);
+	if (mkdir(u->ffs, 0755) && errno != EEXIST) {
+		printf("can't create %s: %s\n", u->ffs, strerror(errno));
+		return -1;
+	}
+	snprintf(func, sizeof(func), "utp%d", id);
+	if (mount(func, u->ffs, "functionfs", 0, NULL) && errno != EBUSY) {
+		printf("can't mount functionfs at %s: %s\n", u->ffs, strerror(errno));
+		return -1;
+	}
+
+	snprintf(func, sizeof(func), "configs/c.1/ffs.utp%d", id);
+	snprintf(dir, sizeof(dir), "functions/ffs.utp%d", id);
+	if (make_link(u->gadget, dir, func) ||
+	    make_link(u->gadget, "configs/c.1", "os_desc/c.1"))
+		return -1;
+
+	return 0;
+}
+
+static void bind_udc(struct udc *u)
+{
+	if (u->bound)
+		return;
+	if (write_attr(u->gadget, "UDC", "%s", u->name) == 0) {
+		u->bound = 1;
+		printf("%s: bound after %lu ms\n", u->name, elapsed_ms());
+	}
+}
+
+/* done with the readiness pipe, ufb told or is gone */
+static void close_ready(struct udc *u)
+{
+	if (u->ready >= 0)
+		close(u->ready);
+	u->ready = -1;
+}
+
+static int start_ufb(struct udc *u)
+{
+	char ep0[64], fd[16];
+	int p[2];
+
+	snprintf(ep0, sizeof(ep0), "%s/ep0", u->ffs);
+
+	/* the write end goes to ufb only */
+	if (pipe2(p, O_CLOEXEC)) {
+		printf("can't create pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	u->pid = fork();
+	if (u->pid < 0) {
+		printf("can't fork: %s\n", strerror(errno));
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	}
+	if (u->pid == 0) {
+		sigset_t set;
+
+		sigemptyset(&set);
+		sigprocmask(SIG_SETMASK, &set, NULL);
+		fcntl(p[1], F_SETFD, 0);
+		snprintf(fd, sizeof(fd), "%d", p[1]);
+		setenv("UFB_READY_FD", fd, 1);
+		execlp(ufb, ufb, ep0, NULL);
+		printf("can't run %s: %s\n", ufb, strerror(errno));
+		_exit(127);
+	}
+	close(p[1]);
+	u->ready = p[0];
+	printf("run utp at %s (pid %d)\n", ep0, u->pid);
+	return 0;
+}
+
+/* an ufb without the pipe, or one that was quicker than us */
+static void check_ep1(struct udc *u)
+{
+	char ep1[64];
+
+	snprintf(ep1, sizeof(ep1), "%s/ep1", u->ffs);
+	if (access(ep1, F_OK) == 0) {
+		bind_udc(u);
+		close_ready(u);
+	}
+}
+
+static void add_udc(const char *name)
+{
+	struct udc *u;
+	int i;
+
+	for (i = 0; i < udc_count; i++)
+		if (strcmp(udcs[i].name, name) == 0)
+			return;
+	if (udc_count == MAX_UDC) {
+		printf("too many UDCs, ignoring %s\n", name);
+		return;
+	}
+
+	u = &udcs[udc_count];
+	memset(u, 0, sizeof(*u));
+	u->ready = -1;
+	snprintf(u->name, sizeof(u->name), "%s", name);
+	printf("Found New UDC: %s\n", name);
+
+	if (setup_gadget(u, udc_count))
+		return;
+	udc_count++;
+
+	if (start_ufb(u))
+		return;
+	check_ep1(u);
+}
+
+static void scan_udcs(void)
+{
+	struct dirent *d;
+	DIR *dir;
+
+	dir = opendir(UDC_DIR);
+	if (!dir) {
+		printf("No udc Available!\n");
+		return;
+	}
+	while ((d = readdir(dir)))
+		if (d->d_name[0] != '.')
+			add_udc(d->d_name);
+	closedir(dir);
+}
+
+static int open_uevent(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* "add@/devices/.../udc/<name>" followed by KEY=value strings */
+static void handle_uevent(int fd)
+{
+	char buf[4096], *p, *end, *devpath = NULL;
+	int add = 0, udc = 0;
+	ssize_t len;
+
+	len = recv(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return;
+	buf[len] = 0;
+	end = buf + len;
+
+	for (p = buf; p < end; p += strlen(p) + 1) {
+		if (strcmp(p, "ACTION=add") == 0)
+			add = 1;
+		else if (strcmp(p, "SUBSYSTEM=udc") == 0)
+			udc = 1;
+		else if (strncmp(p, "DEVPATH=", 8) == 0)
+			devpath = p + 8;
+	}
+
+	if (add && udc && devpath && strrchr(devpath, '/'))
+		add_udc(strrchr(devpath, '/') + 1);
+}
+
+/* a byte when ufb is ready, end of file when it died before */
+static void handle_ready(struct udc *u)
+{
+	char c;
+
+	if (read(u->ready, &c, 1) == 1)
+		bind_udc(u);
+	close_ready(u);
+}
+
+static void handle_child(int fd)
+{
+	struct signalfd_siginfo si;
+	pid_t pid;
+	int i, status;
+
+	if (read(fd, &si, sizeof(si)) != sizeof(si))
+		return;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < udc_count; i++) {
+			if (udcs[i].pid != pid)
+				continue;
+			printf("%s: ufb exited with status %d\n", udcs[i].name,
+			       WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+			udcs[i].pid = 0;
+		}
+	}
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [-u <ufb>] [-p <idProduct>]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd fds[2 + MAX_UDC];
+	int slot[MAX_UDC];
+	sigset_t set;
+	int opt, i, n, timeout;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while ((opt = getopt(argc, argv, "u:p:h")) != -1) {
+		switch (opt) {
+		case 'u':
+			ufb = optarg;
+			break;
+		case 'p':
+			product = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	fds[0].fd = open_uevent();
+	fds[1].fd = signalfd(-1, &set, SFD_CLOEXEC);
+	if (fds[0].fd < 0 || fds[1].fd < 0) {
+		printf("can't set up event sources: %s\n", strerror(errno));
+		return 1;
+	}
+	fds[0].events = fds[1].events = POLLIN;
+
+	/* listen first, then scan, so no UDC falls in between */
+	scan_udcs();
+
+	while (1) {
+		n = 2;
+		timeout = -1;
+		for (i = 0; i < udc_count; i++) {
+			if (udcs[i].bound || !udcs[i].pid)
+				continue;
+			timeout = READY_POLL_MS;
+			if (udcs[i].ready >= 0) {
+				slot[n - 2] = i;
+				fds[n].fd = udcs[i].ready;
+				fds[n++].events = POLLIN;
+			}
+		}
+
+		if (poll(fds, n, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("poll failed: %s\n", strerror(errno));
+			return 1;
+		}
+		for (i = 2; i < n; i++)
+			if (fds[i].revents)
+				handle_ready(&udcs[slot[i - 2]]);
+		if (fds[0].revents & POLLIN)
+			handle_uevent(fds[0].fd);
+		if (fds[1].revents & POLLIN)
+			handle_child(fds[1].fd);
+		/* fallback for a ufb that never reports readiness */
+		for (i = 0; i < udc_count; i++)
+			if (!udcs[i].bound && udcs[i].pid)
+				check_ep1(&udcs[i]);
+	}
+
+	return 0;
+}
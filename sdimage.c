@@ -17,6 +17,7 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <endian.h>
 #include <sys/types.h>
@@ -30,6 +31,9 @@
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
 
 #define max(a,b) \
 	({ __typeof__ (a) _a = (a); \
@@ -177,13 +181,671 @@ void bcb_to_disk(struct bcb *bcb)
 	bcb->num_copies         = htole32(bcb->num_copies);
 }
 
+/* granularity of --skip-identical and --verify */
+#define COMPARE_CHUNK (64 * 1024)
+
+/* amount of firmware read from a stream at once */
+#define STREAM_CHUNK (1024 * 1024)
+
+/* --create lays out a new image: the bootstream partition starts at 1 MB
+ * and is at least 16 MB, like the one created by uuc's 'ffs'
+ */
+#define CREATE_PART_START   2048
+#define CREATE_PART_SECTORS (16 * 1024 * 1024 / SECTOR_SIZE)
+
+/* block size at which zeroes are left as holes in created images */
+#define SPARSE_BLOCK 4096
+
+/* settings shared by all targets */
+static size_t create_size;
+static int skip_identical;
+static int verify;
+static int verbose;
+static int image_alignment = DEFAULT_IMAGE_ALIGNMENT; /* in kB */
+static int sector_offset;
+
+/* the firmware is mapped once and shared by all targets,
+ * it's NULL while the firmware is streamed from stdin
+ */
+static const char *fw;
+static size_t fw_size;
+
+/* a device or image file to install the firmware on */
+struct target {
+	const char *name;
+	pthread_t thread;
+	int rv;
+	int fd;
+	off_t first, second;                /* byte offsets of the two copies      */
+	int sparse;                         /* holes needn't be written            */
+	size_t written;                     /* bytes actually written              */
+	double start, seconds;
+	char error[256];                    /* last error, for the summary         */
+};
+
+/* with several targets, messages are prefixed with the target name */
+static int multi;
+
+static void info(struct target *t, const char *fmt, ...)
+{
+	char line[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+
+	if (multi)
+		printf("%s: %s", t->name, line);
+	else
+		printf("%s", line);
+}
+
+static void error(struct target *t, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(t->error, sizeof(t->error), fmt, ap);
+	va_end(ap);
+
+	if (multi)
+		fprintf(stderr, "%s: %s", t->name, t->error);
+	else
+		fprintf(stderr, "%s", t->error);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* pread() until 'size' bytes are read, short reads only at end of file */
+static ssize_t pread_full(int fd, void *buf, size_t size, off_t pos)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < size) {
+		r = pread(fd, (char *)buf + done, size - done, pos + done);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return r == 0 ? (ssize_t)done : -1;
+		done += r;
+	}
+
+	return done;
+}
+
+/* read() until 'size' bytes are read, for pipes delivering data piecemeal */
+static ssize_t read_full(int fd, void *buf, size_t size)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < size) {
+		r = read(fd, (char *)buf + done, size - done);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return r == 0 ? (ssize_t)done : -1;
+		done += r;
+	}
+
+	return done;
+}
+
+static int is_zero(const char *buf, size_t size)
+{
+	return size == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, size - 1) == 0);
+}
+
+/* write 'size' bytes of 'buf' at byte offset 'pos';
+ * zeroes are left out on fresh sparse images,
+ * with --skip-identical, ranges which already hold the data are only read
+ */
+int write_data(struct target *t, const char *buf, size_t size, off_t pos)
+{
+	char *cmp = NULL;
+	size_t done, len;
+	ssize_t w;
+	int rv = -1;
+
+	if (skip_identical) {
+		cmp = malloc(COMPARE_CHUNK);
+		if (!cmp)
+			return -1;
+	}
+
+	for (done = 0; done < size; done += len) {
+		len = size - done;
+		if (t->sparse) {
+			if (len > SPARSE_BLOCK)
+				len = SPARSE_BLOCK;
+			if (is_zero(buf + done, len))
+				continue;
+		} else if (skip_identical) {
+			if (len > COMPARE_CHUNK)
+				len = COMPARE_CHUNK;
+			if (pread_full(t->fd, cmp, len, pos + done) == len &&
+			    memcmp(cmp, buf + done, len) == 0)
+				continue;
+		}
+
+		w = pwrite(t->fd, buf + done, len, pos + done);
+		if (w != len) {
+			if (w >= 0)
+				errno = EIO;
+			goto out;
+		}
+		t->written += len;
+	}
+
+	rv = 0;
+
+out:
+	free(cmp);
+	return rv;
+}
+
+/* read 'size' bytes at byte offset 'pos' back from the medium and compare
+ * them with 'buf'
+ */
+int verify_data(struct target *t, const char *buf, size_t size, off_t pos)
+{
+	char *cmp;
+	size_t done, len;
+	int rv = -1;
+
+	cmp = malloc(COMPARE_CHUNK);
+	if (!cmp)
+		return -1;
+
+	/* make sure the data comes from the medium, not the page cache */
+	posix_fadvise(t->fd, pos, size, POSIX_FADV_DONTNEED);
+
+	for (done = 0; done < size; done += len) {
+		len = size - done;
+		if (len > COMPARE_CHUNK)
+			len = COMPARE_CHUNK;
+		if (pread_full(t->fd, cmp, len, pos + done) != len ||
+		    memcmp(cmp, buf + done, len) != 0) {
+			error(t, "Verify failed in %zu bytes at offset %lld\n",
+			      len, (long long int)(pos + done));
+			errno = EIO;
+			goto out;
+		}
+	}
+
+	rv = 0;
+
+out:
+	free(cmp);
+	return rv;
+}
+
+/* write 'size' bytes of 'buf' at byte offset 'pos' and sync them to the medium;
+ * with --verify, everything is read back from the medium and compared
+ */
+int write_image(struct target *t, const char *buf, size_t size, off_t pos)
+{
+	size_t before = t->written;
+
+	if (write_data(t, buf, size, pos) == -1)
+		return -1;
+
+	if (t->written != before && fsync(t->fd) == -1)
+		return -1;
+
+	if (verify)
+		return verify_data(t, buf, size, pos);
+
+	return 0;
+}
+
+/* copy the second firmware to the first one on the medium, for streamed
+ * firmware which is gone once the second copy was written
+ */
+int copy_second_to_first(struct target *t)
+{
+	size_t done, len, before = t->written;
+	ssize_t r;
+	char *buf;
+	int rv = -1;
+
+	buf = malloc(STREAM_CHUNK);
+	if (!buf)
+		return -1;
+
+	for (done = 0; done < fw_size; done += len) {
+		len = fw_size - done;
+		if (len > STREAM_CHUNK)
+			len = STREAM_CHUNK;
+		r = pread_full(t->fd, buf, len, t->second + done);
+		if (r != len) {
+			if (r >= 0)
+				errno = EIO;
+			goto out;
+		}
+		if (write_data(t, buf, len, t->first + done) == -1)
+			goto out;
+	}
+
+	if (t->written != before && fsync(t->fd) == -1)
+		goto out;
+
+	if (verify) {
+		posix_fadvise(t->fd, t->second, fw_size, POSIX_FADV_DONTNEED);
+		for (done = 0; done < fw_size; done += len) {
+			len = fw_size - done;
+			if (len > STREAM_CHUNK)
+				len = STREAM_CHUNK;
+			if (pread_full(t->fd, buf, len, t->second + done) != len ||
+			    verify_data(t, buf, len, t->first + done) == -1) {
+				errno = EIO;
+				goto out;
+			}
+		}
+	}
+
+	rv = 0;
+
+out:
+	free(buf);
+	return rv;
+}
+
+/* report a step of the installation, 'rv' being its outcome */
+int report(struct target *t, const char *what, int rv, size_t before, size_t size)
+{
+	if (rv == -1) {
+		if (verbose) {
+			snprintf(t->error, sizeof(t->error), "%s failed: %s\n", what, strerror(errno));
+			info(t, "%s... failed: %s\n", what, strerror(errno));
+		} else {
+			error(t, "%s failed: %s\n", what, strerror(errno));
+		}
+		return -1;
+	}
+
+	if (verbose) {
+		if (t->written - before == size)
+			info(t, "%s... ok.\n", what);
+		else
+			info(t, "%s... ok, %zu of %zu bytes written.\n",
+			     what, t->written - before, size);
+	}
+
+	return 0;
+}
+
+/* write one part of the bootstream partition and tell how it went */
+int install_part(struct target *t, const char *what, const char *buf, size_t size, off_t pos)
+{
+	size_t before = t->written;
+
+	return report(t, what, write_image(t, buf, size, pos), before, size);
+}
+
+/* we assume that we want to have at least two images of the same size
+ * in the bootstream partition, plus the first sector containing the BCB
+ * combined with our desired offset to boot on i.MX23/i.MX28 likewise, plus
+ * the space we use due to image alignment;
+ * so calculate the required minimum partition size mincount (in sectors a 512 byte),
+ * 'offset' is the end of the first image including its alignment, in bytes
+ */
+int required_sectors(int *offset)
+{
+	*offset = sector_offset * SECTOR_SIZE + fw_size;
+	if (image_alignment > 0)
+		*offset = ROUND_UP(*offset, image_alignment * 1024);
+	else
+		*offset = ROUND_UP(*offset, SECTOR_SIZE);
+
+	return SECTOR_COUNT(*offset + fw_size);
+}
+
+/* create a sparse image file with an MBR holding the bootstream partition
+ * and a Linux partition covering the rest; nothing but the MBR is written,
+ * an existing file gets its blocks punched out instead of being rewritten
+ */
+int create_image(struct target *t)
+{
+	struct mbr mbr;
+	struct stat st;
+	uint64_t total = create_size / SECTOR_SIZE;
+	uint32_t start = CREATE_PART_START, count;
+	int i, offset;
+
+	t->fd = open(t->name, O_RDWR | O_CREAT, 0644);
+	if (t->fd == -1) {
+		error(t, "Can't create image '%s': %s\n", t->name, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(t->fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		error(t, "Can't create image '%s': not a regular file\n", t->name);
+		return -1;
+	}
+
+	count = ROUND_UP(max(required_sectors(&offset), CREATE_PART_SECTORS), CREATE_PART_START);
+	if (start + count > total) {
+		error(t, "Image size of %zu bytes is too small, the bootstream partition "
+		      "needs %" PRIu32 " sectors from sector %" PRIu32 ".\n", create_size, count, start);
+		return -1;
+	}
+
+	if (st.st_size &&
+	    fallocate(t->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, st.st_size) == -1 &&
+	    ftruncate(t->fd, 0) == -1) {
+		error(t, "Can't clear image '%s': %s\n", t->name, strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(t->fd, create_size) == -1) {
+		error(t, "Can't resize image '%s': %s\n", t->name, strerror(errno));
+		return -1;
+	}
+
+	memset(&mbr, 0, sizeof(mbr));
+	mbr.partition[0].type = 'S';
+	mbr.partition[0].start = start;
+	mbr.partition[0].count = count;
+	if (total - (start + count) >= CREATE_PART_START) {
+		mbr.partition[1].type = 0x83;
+		mbr.partition[1].start = start + count;
+		mbr.partition[1].count = total - (start + count);
+	}
+	for (i = 0; i < 4; i++) {
+		if (!mbr.partition[i].type)
+			continue;
+		/* LBA only, the CHS fields just say so */
+		memcpy(mbr.partition[i].chs_start, "\xfe\xff\xff", 3);
+		memcpy(mbr.partition[i].chs_end, "\xfe\xff\xff", 3);
+		mbr.partition[i].start = htole32(mbr.partition[i].start);
+		mbr.partition[i].count = htole32(mbr.partition[i].count);
+	}
+	mbr.signature = htole16(MBR_SIGNATURE);
+
+	if (pwrite(t->fd, &mbr, sizeof(mbr), 0) != sizeof(mbr)) {
+		error(t, "Writing MBR to '%s' failed: %s\n", t->name, strerror(errno));
+		return -1;
+	}
+
+	if (verbose) {
+		info(t, "Created %zu byte image, bootstream partition at sector %" PRIu32
+		     " with %" PRIu32 " sectors.\n", create_size, start, count);
+	}
+
+	/* everything is a hole now, zeroes needn't be written */
+	t->sparse = 1;
+	return 0;
+}
+
+/* open the target, lay out the bootstream partition and write the BCB */
+int prepare(struct target *t)
+{
+	struct mbr mbr;
+	struct pte *part;
+	struct bcb bcb;
+	int i, mincount;
+	int offset;
+
+	t->start = now();
+	t->rv = EXIT_FAILURE;
+
+	/* open target device and read MBR with partition table */
+	if (create_size) {
+		if (create_image(t) == -1)
+			return -1;
+	} else {
+		t->fd = open(t->name, O_RDWR);
+		if (t->fd == -1) {
+			error(t, "Can't open device '%s': %s\n", t->name, strerror(errno));
+			return -1;
+		}
+	}
+
+	if (pread_full(t->fd, &mbr, sizeof(mbr), 0) < (ssize_t)sizeof(mbr)) {
+		error(t, "Could not read MBR and partition table of '%s': %s\n", t->name, strerror(errno));
+		return -1;
+	}
+
+	/* partition table is little endian on disk, so convert to host byte order */
+	mbr_to_host(&mbr);
+
+	/* safety check that we found a partition table at all */
+	if (mbr.signature != MBR_SIGNATURE) {
+		error(t, "MBR signature check failed: expected 0x%" PRIx16 ", read 0x%" PRIx16 "\n",
+		      MBR_SIGNATURE, mbr.signature);
+		return -1;
+	}
+
+	/* search bootstream partition */
+	for (i = 0; i < 4; i++) {
+		if (mbr.partition[i].type == 'S') {
+			part = &mbr.partition[i];
+			if (verbose > 1) {
+				info(t, "Bootstream partition found: partition %d, start=%" PRIu32 " length=%" PRIu32 " (sectors)\n",
+				     i, part->start, part->count);
+			}
+			break;
+		}
+	}
+
+	if (i == 4) {
+		error(t, "Could not find bootstream partition.\n");
+		return -1;
+	}
+
+	mincount = required_sectors(&offset);
+
+	if (part->count < mincount) {
+		error(t, "Bootstream partition is too small with %" PRIu32 " sectors.\n"
+		      "With two instances of this firmware and firmware alignment to %d kB,\n"
+		      "we require at least %d sectors (or %d kB).\n",
+		      part->count, image_alignment, mincount, mincount * SECTOR_SIZE / 1024);
+		return -1;
+	}
+
+
+	/* create BCB */
+	memset(&bcb, 0, sizeof(bcb));
+	bcb.signature = BCB_SIGNATURE;
+	bcb.primary_boot_tag = 1;
+	bcb.secondary_boot_tag = 2;
+	bcb.num_copies = 2;
+
+	bcb.drive_info[0].chip_num = 0;
+	bcb.drive_info[0].drive_type = 0;
+	bcb.drive_info[0].tag = bcb.primary_boot_tag;
+	bcb.drive_info[0].first_sector_number = part->start + sector_offset;
+	bcb.drive_info[0].sector_count = SECTOR_COUNT(offset) - sector_offset;
+
+	bcb.drive_info[1].chip_num = 0;
+	bcb.drive_info[1].drive_type = 0;
+	bcb.drive_info[1].tag = bcb.secondary_boot_tag;
+	bcb.drive_info[1].first_sector_number =
+		bcb.drive_info[0].first_sector_number + bcb.drive_info[0].sector_count;
+	bcb.drive_info[1].sector_count = SECTOR_COUNT(fw_size);
+
+	if (verbose > 1) {
+		info(t, "1st bootstream: start sector %" PRIu32 ", sector count %" PRIu32 "\n",
+		     bcb.drive_info[0].first_sector_number, bcb.drive_info[0].sector_count);
+		info(t, "2nd bootstream: start sector %" PRIu32 ", sector count %" PRIu32 "\n",
+		     bcb.drive_info[1].first_sector_number, bcb.drive_info[1].sector_count);
+	}
+
+	t->first = (off_t)bcb.drive_info[0].first_sector_number * SECTOR_SIZE;
+	t->second = (off_t)bcb.drive_info[1].first_sector_number * SECTOR_SIZE;
+
+	/* convert bcb to disk byte order for writing */
+	bcb_to_disk(&bcb);
+
+	return install_part(t, "Updating BCB", (char *)&bcb, sizeof(bcb),
+	                    (off_t)part->start * SECTOR_SIZE);
+}
+
+/* release the target and account the time it took */
+void finish(struct target *t, int rv)
+{
+	if (t->fd != -1)
+		close(t->fd);
+	t->fd = -1;
+	t->rv = rv;
+	t->seconds = now() - t->start;
+}
+
+/* install the mapped firmware on one target, runs in a thread of its own */
+void *install(void *arg)
+{
+	struct target *t = arg;
+	int rv = EXIT_FAILURE;
+
+	/* the second copy goes first, so the first one stays intact meanwhile */
+	if (prepare(t) == 0 &&
+	    install_part(t, "Writing second firmware", fw, fw_size, t->second) == 0 &&
+	    install_part(t, "Writing first firmware", fw, fw_size, t->first) == 0)
+		rv = EXIT_SUCCESS;
+
+	finish(t, rv);
+	return NULL;
+}
+
+/* finish a streamed installation by copying the second firmware to the first */
+void *install_first_from_second(void *arg)
+{
+	struct target *t = arg;
+	size_t before = t->written;
+	int rv = EXIT_FAILURE;
+
+	if (report(t, "Writing first firmware", copy_second_to_first(t), before, fw_size) == 0)
+		rv = EXIT_SUCCESS;
+
+	finish(t, rv);
+	return NULL;
+}
+
+/* 64-bit FNV-1a, to check the second copy of streamed firmware */
+static uint64_t fnv1a(uint64_t h, const char *buf, size_t size)
+{
+	while (size--) {
+		h ^= (uint8_t)*buf++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+/* checksum 'size' bytes of the medium at byte offset 'pos' */
+static int fnv1a_medium(struct target *t, off_t pos, size_t size, char *buf, uint64_t *h)
+{
+	size_t done, len;
+
+	posix_fadvise(t->fd, pos, size, POSIX_FADV_DONTNEED);
+	*h = FNV1A_INIT;
+	for (done = 0; done < size; done += len) {
+		len = size - done;
+		if (len > STREAM_CHUNK)
+			len = STREAM_CHUNK;
+		if (pread_full(t->fd, buf, len, pos + done) != len)
+			return -1;
+		*h = fnv1a(*h, buf, len);
+	}
+	return 0;
+}
+
+/* write the second firmware of all targets while it arrives on 'in_fd',
+ * returns the number of targets still alive
+ */
+int stream_second(struct target *targets, int count, int in_fd)
+{
+	uint64_t hash = FNV1A_INIT, h;
+	size_t pos, len, *before;
+	int i, alive = 0;
+	ssize_t r;
+	char *buf;
+
+	buf = malloc(STREAM_CHUNK);
+	before = calloc(count, sizeof(*before));
+	if (!buf || !before) {
+		fprintf(stderr, "Out of memory\n");
+		free(buf);
+		free(before);
+		return 0;
+	}
+
+	for (i = 0; i < count; i++)
+		before[i] = targets[i].written;
+
+	for (pos = 0; pos < fw_size; pos += r) {
+		len = fw_size - pos;
+		if (len > STREAM_CHUNK)
+			len = STREAM_CHUNK;
+		r = read_full(in_fd, buf, len);
+		if (r <= 0)
+			break;
+
+		hash = fnv1a(hash, buf, r);
+		for (i = 0; i < count; i++) {
+			struct target *t = &targets[i];
+
+			if (t->fd != -1 && write_data(t, buf, r, t->second + pos) == -1) {
+				report(t, "Writing second firmware", -1, 0, 0);
+				finish(t, EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (pos < fw_size)
+		fprintf(stderr, "Firmware stream ended after %zu of %zu bytes\n", pos, fw_size);
+	else if (read(in_fd, buf, 1) > 0)
+		fprintf(stderr, "Warning: firmware stream is longer than %zu bytes, ignoring the rest\n", fw_size);
+
+	for (i = 0; i < count; i++) {
+		struct target *t = &targets[i];
+		int rv = 0;
+
+		if (t->fd == -1)
+			continue;
+
+		if (pos < fw_size) {
+			errno = EPIPE;
+			rv = -1;
+		} else if (t->written != before[i] && fsync(t->fd) == -1) {
+			rv = -1;
+		} else if (verify && (fnv1a_medium(t, t->second, fw_size, buf, &h) == -1 || h != hash)) {
+			error(t, "Verify of the second firmware failed\n");
+			errno = EIO;
+			rv = -1;
+		}
+
+		if (report(t, "Writing second firmware", rv, before[i], fw_size) == -1)
+			finish(t, EXIT_FAILURE);
+		else
+			alive++;
+	}
+
+	free(before);
+	free(buf);
+	return alive;
+}
+
 #define DEFAULT_DEVICE "/dev/mmcblk0"
 
 /* command line options */
 const struct option long_options[] = {
 	{ "alignment",        required_argument,   0, 'a' },
+	{ "create",           required_argument,   0, 'c' },
 	{ "device",           required_argument,   0, 'd' },
 	{ "firmware",         required_argument,   0, 'f' },
+	{ "size",             required_argument,   0, 'S' },
+	{ "skip-identical",   no_argument,         0, 's' },
+	{ "verify",           no_argument,         0, 'V' },
 	{ "verbose",          no_argument,         0, 'v' },
 	{ "help",             no_argument,         0, 'h' },
 	/* stop condition for iterator */
@@ -193,8 +855,12 @@ const struct option long_options[] = {
 /* command line help descriptions */
 const char *long_options_descs[] = {
 	"align second firmware image to given offset (default: " __stringify(DEFAULT_IMAGE_ALIGNMENT) " kB)",
-	"device to write firmware to (default: " DEFAULT_DEVICE ")",
-	"firmware file to write",
+	"create sparse image files of given size (k, M, G suffixes) with a new partition table",
+	"device to write firmware to, give several times to program them in parallel (default: " DEFAULT_DEVICE ")",
+	"firmware file to write, '-' to read it from stdin",
+	"size of the firmware read from stdin, to write while it's arriving",
+	"only write the ranges which differ from the medium",
+	"read back and compare everything written",
 	"be verbose in what's going on (give twice to print debug messages)",
 	"print this usage and exit",
 	/* stop condition for iterator */
@@ -208,7 +874,7 @@ void usage(const char *progname, int exitcode)
 
 	fprintf(stderr,
 	        "%s -- tool to install i.MX23/28 bootstreams in devices or image files\n\n"
-	        "Usage: %s [options] -f <firmware>\n\n"
+	        "Usage: %s [options] -f <firmware> [<device>...]\n\n"
 	        "Options:\n",
 	        progname, progname);
 	while (op->name && desc) {
@@ -234,24 +900,105 @@ int parse_alignment(const char *arg)
 	return value;
 }
 
+/* read all of a firmware stream of unknown size into memory */
+char *slurp(int fd, size_t *size)
+{
+	size_t alloc = STREAM_CHUNK;
+	char *buf, *p;
+	ssize_t r;
+
+	*size = 0;
+	buf = malloc(alloc);
+	while (buf) {
+		r = read_full(fd, buf + *size, alloc - *size);
+		if (r < 0) {
+			free(buf);
+			return NULL;
+		}
+		*size += r;
+		if (*size < alloc)
+			return buf;
+
+		alloc *= 2;
+		p = realloc(buf, alloc);
+		if (!p)
+			free(buf);
+		buf = p;
+	}
+
+	return NULL;
+}
+
+/* run 'fn' on every target still alive, in parallel with several targets */
+void run_targets(struct target *targets, int count, void *(*fn)(void *))
+{
+	int i;
+
+	if (!multi) {
+		if (targets[0].fd != -1 || fn == install)
+			fn(&targets[0]);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		targets[i].thread = 0;
+		if (targets[i].fd == -1 && fn != install)
+			continue;
+		if (pthread_create(&targets[i].thread, NULL, fn, &targets[i])) {
+			snprintf(targets[i].error, sizeof(targets[i].error),
+			         "Can't start worker\n");
+			finish(&targets[i], EXIT_FAILURE);
+			targets[i].thread = 0;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if (targets[i].thread)
+			pthread_join(targets[i].thread, NULL);
+	}
+}
+
+size_t parse_size(const char *arg)
+{
+	unsigned long long value;
+	char *endptr;
+
+	value = strtoull(arg, &endptr, 0);
+	switch (*endptr) {
+		case 'G': case 'g':
+			value *= 1024;
+			/* fall-through */
+		case 'M': case 'm':
+			value *= 1024;
+			/* fall-through */
+		case 'K': case 'k':
+			value *= 1024;
+			endptr++;
+	}
+	if (*endptr) {
+		fprintf(stderr, "Error: garbage after size value: %s\n", endptr);
+		exit(EXIT_FAILURE);
+	}
+
+	return value;
+}
+
 int main(int argc, char *argv[])
 {
-	char *devicename = DEFAULT_DEVICE;
+	const char **devices = NULL;
+	int device_count = 0;
 	char *firmware = NULL;
-	struct mbr mbr;
-	struct pte *part;
-	struct bcb bcb;
+	struct target *targets;
 	int rv = EXIT_FAILURE;
-	int dev_fd = -1, fw_fd = -1;
+	int fw_fd = -1;
 	struct stat fw_stat;
-	char *fw = NULL;
-	int i, mincount, sector_offset = max(SECTOR_COUNT(sizeof(struct bcb)), IMAGE_OFFSET);
-	int image_alignment = DEFAULT_IMAGE_ALIGNMENT; /* in kB */
-	int offset;
-	int verbose = 0;
+	size_t declared_size = 0;
+	char *fw_buf = NULL;
+	int i;
+
+	sector_offset = max(SECTOR_COUNT(sizeof(struct bcb)), IMAGE_OFFSET);
 
 	while (1) {
-		int c = getopt_long(argc, argv, "a:d:f:vh", long_options, NULL);
+		int c = getopt_long(argc, argv, "a:c:d:f:S:sVvh", long_options, NULL);
 
 		/* detect the end of the options */
 		if (c == -1)
@@ -265,12 +1012,29 @@ int main(int argc, char *argv[])
 					image_alignment = DEFAULT_IMAGE_ALIGNMENT;
 				}
 				break;
+			case 'c':
+				create_size = ROUND_UP(parse_size(optarg), SECTOR_SIZE);
+				break;
 			case 'd':
-				devicename = optarg;
+				devices = realloc(devices, (device_count + 1) * sizeof(*devices));
+				if (!devices) {
+					fprintf(stderr, "Out of memory\n");
+					exit(EXIT_FAILURE);
+				}
+				devices[device_count++] = optarg;
 				break;
 			case 'f':
 				firmware = optarg;
 				break;
+			case 'S':
+				declared_size = parse_size(optarg);
+				break;
+			case 's':
+				skip_identical = 1;
+				break;
+			case 'V':
+				verify = 1;
+				break;
 			case 'v':
 				verbose += 1;
 				break;
@@ -286,11 +1050,31 @@ int main(int argc, char *argv[])
 	if (!firmware)
 		usage(argv[0], rv);
 
+	/* remaining arguments are further devices */
+	targets = calloc(device_count + argc - optind + 1, sizeof(*targets));
+	if (!targets) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < device_count; i++)
+		targets[i].name = devices[i];
+	while (optind < argc)
+		targets[device_count++].name = argv[optind++];
+	if (!device_count)
+		targets[device_count++].name = DEFAULT_DEVICE;
+	for (i = 0; i < device_count; i++)
+		targets[i].fd = -1;
+	multi = device_count > 1;
+
 	/* open firmware file and memory map it */
-	fw_fd = open(firmware, O_RDONLY);
-	if (fw_fd == -1) {
-		fprintf(stderr, "Can't open firmware '%s': %s\n", firmware, strerror(errno));
-		goto close_out;
+	if (strcmp(firmware, "-") == 0) {
+		fw_fd = STDIN_FILENO;
+	} else {
+		fw_fd = open(firmware, O_RDONLY);
+		if (fw_fd == -1) {
+			fprintf(stderr, "Can't open firmware '%s': %s\n", firmware, strerror(errno));
+			goto close_out;
+		}
 	}
 
 	if (fstat(fw_fd, &fw_stat) == -1) {
@@ -298,192 +1082,72 @@ int main(int argc, char *argv[])
 		goto close_out;
 	}
 
-	fw = (char *)mmap(NULL, fw_stat.st_size, PROT_READ, MAP_PRIVATE, fw_fd, 0);
-	if (fw == MAP_FAILED) {
-		fprintf(stderr, "mmap(%s) failed: %s\n", firmware, strerror(errno));
-		goto close_out;
-	}
-
-	if (verbose > 1) {
-		printf("Firmware size: %lld bytes, %lld sectors\n",
-		       (long long int)fw_stat.st_size, (long long int)SECTOR_COUNT(fw_stat.st_size));
-	}
-
-	/* open target device and read MBR with partition table */
-	dev_fd = open(devicename, O_RDWR);
-	if (dev_fd == -1) {
-		fprintf(stderr, "Can't open device '%s': %s\n", devicename, strerror(errno));
-		goto close_out;
-	}
-
-	if (read(dev_fd, &mbr, sizeof(mbr)) < sizeof(mbr)) {
-		fprintf(stderr, "Could not read MBR and partition table of '%s': %s", devicename, strerror(errno));
-		goto close_out;
-	}
-
-	/* partition table is little endian on disk, so convert to host byte order */
-	mbr_to_host(&mbr);
-
-	/* safety check that we found a partition table at all */
-	if (mbr.signature != MBR_SIGNATURE) {
-		fprintf(stderr, "MBR signature check failed: expected 0x%" PRIx16 ", read 0x%" PRIx16 "\n",
-		        MBR_SIGNATURE, mbr.signature);
-		goto unmap_out;
-	}
-
-	/* search bootstream partition */
-	for (i = 0; i < 4; i++) {
-		if (mbr.partition[i].type == 'S') {
-			part = &mbr.partition[i];
-			if (verbose > 1) {
-				printf("Bootstream partition found: partition %d, start=%" PRIu32 " length=%" PRIu32 " (sectors)\n",
-				       i, part->start, part->count);
-			}
-			break;
+	if (S_ISREG(fw_stat.st_mode)) {
+		fw_size = fw_stat.st_size;
+		fw = (char *)mmap(NULL, fw_size, PROT_READ, MAP_PRIVATE, fw_fd, 0);
+		if (fw == MAP_FAILED) {
+			fprintf(stderr, "mmap(%s) failed: %s\n", firmware, strerror(errno));
+			goto close_out;
 		}
-	}
-
-	if (i == 4) {
-		fprintf(stderr, "Could not find bootstream partition.\n");
-		goto unmap_out;
-	}
-
-	/* we assume that we want to have at least two images of the same size
-	 * in the bootstream partition, plus the first sector containing the BCB
-	 * combined with our desired offset to boot on i.MX23/i.MX28 likewise, plus
-	 * the space we use due to image alignment;
-	 * so calculate the required minimum partition size mincount (in sectors a 512 byte)
-	 */
-	offset = sector_offset * SECTOR_SIZE + fw_stat.st_size;
-	if (image_alignment > 0)
-		offset = ROUND_UP(offset, image_alignment * 1024);
-	else
-		offset = ROUND_UP(offset, SECTOR_SIZE);
-
-	mincount = SECTOR_COUNT(offset + fw_stat.st_size);
-
-	if (part->count < mincount) {
-		fprintf(stderr, "Bootstream partition is too small with %" PRIu32 " sectors.\n", part->count);
-		fprintf(stderr, "With two instances of this firmware and firmware alignment to %d kB,\n", image_alignment);
-		fprintf(stderr, "we require at least %d sectors (or %d kB).\n", mincount, mincount * SECTOR_SIZE / 1024);
-		goto unmap_out;
-	}
-
-
-	/* create BCB */
-	memset(&bcb, 0, sizeof(bcb));
-	bcb.signature = BCB_SIGNATURE;
-	bcb.primary_boot_tag = 1;
-	bcb.secondary_boot_tag = 2;
-	bcb.num_copies = 2;
-
-	bcb.drive_info[0].chip_num = 0;
-	bcb.drive_info[0].drive_type = 0;
-	bcb.drive_info[0].tag = bcb.primary_boot_tag;
-	bcb.drive_info[0].first_sector_number = part->start + sector_offset;
-	bcb.drive_info[0].sector_count = SECTOR_COUNT(offset) - sector_offset;
-
-	bcb.drive_info[1].chip_num = 0;
-	bcb.drive_info[1].drive_type = 0;
-	bcb.drive_info[1].tag = bcb.secondary_boot_tag;
-	bcb.drive_info[1].first_sector_number =
-		bcb.drive_info[0].first_sector_number + bcb.drive_info[0].sector_count;
-	bcb.drive_info[1].sector_count = SECTOR_COUNT(fw_stat.st_size);
-
-	if (verbose > 1) {
-		fprintf(stderr, "1st bootstream:\n");
-		fprintf(stderr, "\tstart sector: %" PRIu32 "\n", bcb.drive_info[0].first_sector_number);
-		fprintf(stderr, "\tsector count: %" PRIu32 "\n", bcb.drive_info[0].sector_count);
-		fprintf(stderr, "2nd bootstream:\n");
-		fprintf(stderr, "\tstart sector: %" PRIu32 "\n", bcb.drive_info[1].first_sector_number);
-		fprintf(stderr, "\tsector count: %" PRIu32 "\n", bcb.drive_info[1].sector_count);
-	}
-
-	/* convert bcb to disk byte order for writing */
-	bcb_to_disk(&bcb);
-
-	if (verbose) {
-		printf("Updating BCB... ");
-	}
-
-	lseek(dev_fd, part->start * SECTOR_SIZE, SEEK_SET);
-	if (write(dev_fd, &bcb, sizeof(bcb)) != sizeof(bcb)) {
-		if (verbose) {
-			printf("failed: %s\n", strerror(errno));
-		} else {
-			fprintf(stderr, "Writing BCB to '%s' failed: %s\n", devicename, strerror(errno));
-		}
-		goto unmap_out;
+	} else if (declared_size) {
+		/* streamed, the second copy is written while the data arrives */
+		fw_size = declared_size;
 	} else {
-		if (verbose) {
-			printf("ok.\n");
+		/* the layout depends on the size, so a stream has to be read first */
+		fw_buf = slurp(fw_fd, &fw_size);
+		if (!fw_buf) {
+			fprintf(stderr, "Can't read firmware '%s': %s\n", firmware, strerror(errno));
+			goto close_out;
 		}
+		fw = fw_buf;
 	}
 
-	if (fsync(dev_fd) == -1) {
-		fprintf(stderr, "fsync(%s) failed: %s\n", devicename, strerror(errno));
-		goto unmap_out;
-	}
-
-	/* convert bcb back to host byte order */
-	bcb_to_host(&bcb);
-
-	if (verbose) {
-		printf("Writing second firmware... ");
+	if (verbose > 1) {
+		printf("Firmware size: %lld bytes, %lld sectors\n",
+		       (long long int)fw_size, (long long int)SECTOR_COUNT(fw_size));
 	}
 
-	lseek(dev_fd, bcb.drive_info[1].first_sector_number * SECTOR_SIZE, SEEK_SET);
-	if (write(dev_fd, fw, fw_stat.st_size) != fw_stat.st_size) {
-		if (verbose) {
-			printf("failed: %s\n", strerror(errno));
-		} else {
-			fprintf(stderr, "Writing second firmware failed: %s\n", strerror(errno));
-		}
-		goto unmap_out;
+	if (fw) {
+		/* one worker per target, all sharing the single copy of the firmware */
+		run_targets(targets, device_count, install);
 	} else {
-		if (fsync(dev_fd) == -1) {
-			fprintf(stderr, "fsync(%s) failed: %s\n", devicename, strerror(errno));
-			goto unmap_out;
-		}
-
-		if (verbose) {
-			printf("ok.\n");
+		for (i = 0; i < device_count; i++) {
+			if (prepare(&targets[i]) == -1)
+				finish(&targets[i], EXIT_FAILURE);
 		}
+		if (stream_second(targets, device_count, fw_fd))
+			run_targets(targets, device_count, install_first_from_second);
 	}
 
-	if (verbose) {
-		printf("Writing first firmware... ");
+	rv = EXIT_SUCCESS;
+	for (i = 0; i < device_count; i++) {
+		if (targets[i].rv != EXIT_SUCCESS)
+			rv = EXIT_FAILURE;
 	}
 
-	lseek(dev_fd, bcb.drive_info[0].first_sector_number * SECTOR_SIZE, SEEK_SET);
-	if (write(dev_fd, fw, fw_stat.st_size) != fw_stat.st_size) {
-		if (verbose) {
-			printf("failed: %s\n", strerror(errno));
-		} else {
-			fprintf(stderr, "Writing first firmware failed: %s\n", strerror(errno));
-		}
-		goto unmap_out;
-	} else {
-		if (fsync(dev_fd) == -1) {
-			fprintf(stderr, "fsync(%s) failed: %s\n", devicename, strerror(errno));
-			goto unmap_out;
-		}
+	if (multi) {
+		printf("\nSummary:\n");
+		for (i = 0; i < device_count; i++) {
+			struct target *t = &targets[i];
 
-		if (verbose) {
-			printf("ok.\n");
+			if (t->rv == EXIT_SUCCESS)
+				printf("\t%-24s ok, %zu bytes written in %.2f s\n",
+				       t->name, t->written, t->seconds);
+			else
+				printf("\t%-24s FAILED: %s", t->name, t->error);
 		}
 	}
 
-	rv = EXIT_SUCCESS;
-
-unmap_out:
-	munmap(fw, fw_stat.st_size);
+	if (fw_buf)
+		free(fw_buf);
+	else if (fw)
+		munmap((void *)fw, fw_size);
 
 close_out:
-	if (dev_fd != -1)
-		close(dev_fd);
-	if (fw_fd != -1)
+	if (fw_fd != -1 && fw_fd != STDIN_FILENO)
 		close(fw_fd);
+	free(targets);
+	free(devices);
 
 	return rv;
 }
@@ -0,0 +1,1502 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Storage helpers shared by the uuc and ufb daemons
+ *
+ * Copyright (C) 2024 NXP
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <mtd/mtd-user.h>
+
+#include "storage.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* size of the buffers used by the memory benchmarks */
+#define BENCH_MEM_SIZE		(8 << 20)
+#define BENCH_MEM_LOOPS		8
+
+/* largest single request of the sequential benchmarks */
+#define BENCH_SEQ_CHUNK		(1 << 20)
+
+uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t kb_per_sec(uint64_t bytes, uint64_t us)
+{
+	if (!us)
+		us = 1;
+	return bytes * 1000000 / 1024 / us;
+}
+
+void tuner_init(struct xfer_tuner *t, size_t min, size_t max, size_t size)
+{
+	memset(t, 0, sizeof(*t));
+	t->min = min;
+	t->max = max < min ? min : max;
+	t->size = size < min ? min : size > t->max ? t->max : size;
+}
+
+void tuner_update(struct xfer_tuner *t, uint64_t bytes, uint64_t us)
+{
+	uint32_t rate;
+
+	t->bytes += bytes;
+	t->us += us;
+
+	/* judge over a few transfers so a single hiccup doesn't count */
+	if (t->bytes < 4 * (uint64_t)t->size)
+		return;
+
+	rate = kb_per_sec(t->bytes, t->us);
+	if (rate > t->rate + t->rate / 16 && t->size < t->max)
+		t->size *= 2;
+	else if (rate < t->rate - t->rate / 8 && t->size > t->min)
+		t->size /= 2;
+	t->rate = rate;
+	t->bytes = t->us = 0;
+}
+
+uint64_t mem_available(void)
+{
+	unsigned long long kb = 0;
+	char line[128];
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1)
+			break;
+	}
+	fclose(f);
+	return (uint64_t)kb * 1024;
+}
+
+size_t max_buffer_size(size_t limit)
+{
+	uint64_t avail = mem_available() / 4;
+	size_t size = 4096;
+
+	while (size * 2 <= avail && size * 2 <= limit)
+		size *= 2;
+	return size;
+}
+
+static uint32_t crc32_table[256];
+
+static void crc32_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crc32_table[i] = c;
+	}
+}
+
+/* IEEE 802.3 CRC-32, the one used by zlib, pass 0 to start */
+uint32_t crc32(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	if (!crc32_table[1])
+		crc32_init();
+
+	crc = ~crc;
+	while (len--)
+		crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(struct sha256_ctx *ctx, const uint8_t *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 |
+		       p[4 * i + 2] << 8 | p[4 * i + 3];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+		       (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+		       (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	a = ctx->h[0]; b = ctx->h[1]; c = ctx->h[2]; d = ctx->h[3];
+	e = ctx->h[4]; f = ctx->h[5]; g = ctx->h[6]; h = ctx->h[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+		     ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+		     ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
+	ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h;
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+	static const uint32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->h, h0, sizeof(h0));
+	ctx->len = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t used = ctx->len % 64, n;
+
+	ctx->len += len;
+	if (used) {
+		n = len < 64 - used ? len : 64 - used;
+		memcpy(ctx->buf + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		sha256_block(ctx, ctx->buf);
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		sha256_block(ctx, p);
+	memcpy(ctx->buf, p, len);
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[32])
+{
+	uint64_t bits = ctx->len * 8;
+	size_t used = ctx->len % 64;
+	int i;
+
+	ctx->buf[used++] = 0x80;
+	if (used > 56) {
+		memset(ctx->buf + used, 0, 64 - used);
+		sha256_block(ctx, ctx->buf);
+		used = 0;
+	}
+	memset(ctx->buf + used, 0, 56 - used);
+	for (i = 0; i < 8; i++)
+		ctx->buf[56 + i] = bits >> (56 - 8 * i);
+	sha256_block(ctx, ctx->buf);
+
+	for (i = 0; i < 8; i++) {
+		digest[4 * i] = ctx->h[i] >> 24;
+		digest[4 * i + 1] = ctx->h[i] >> 16;
+		digest[4 * i + 2] = ctx->h[i] >> 8;
+		digest[4 * i + 3] = ctx->h[i];
+	}
+}
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES	16
+#define URING_FILES	8
+
+/* what a buffer is used for */
+#define BUF_FREE	0
+#define BUF_WRITE	1
+#define BUF_READ	2
+#define BUF_DONE	3	/* read completed */
+
+/* user_data of requests without a buffer */
+#define URING_NOBUF	(~0ULL)
+
+struct uring {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_len, cq_len;
+	unsigned queued;	/* prepared, not submitted */
+	unsigned inflight;	/* submitted, not completed */
+	int fixed_bufs;		/* buffers registered */
+	int fixed_files;	/* file table registered */
+	int batch;		/* hold submissions until uring_fsync() */
+	struct iovec iov[URING_BUFS];
+	int state[URING_BUFS];
+	int res[URING_BUFS];	/* of a completed read */
+	int files[URING_FILES];
+	int err;		/* first failed write */
+};
+
+static int uring_enter(struct uring *r, unsigned submit, unsigned wait)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, submit, wait,
+			      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret < 0 ? -errno : ret;
+}
+
+static void uring_reap(struct uring *r)
+{
+	unsigned head = *r->cq_head;
+	struct io_uring_cqe *cqe;
+	uint64_t i;
+
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &r->cqes[head & *r->cq_mask];
+		i = cqe->user_data;
+		if (i == URING_NOBUF) {
+			if (cqe->res < 0 && !r->err)
+				r->err = cqe->res;
+		} else if (r->state[i] == BUF_WRITE) {
+			/* a short write of a regular file or device is an error */
+			if (cqe->res != (int)r->iov[i].iov_len && !r->err)
+				r->err = cqe->res < 0 ? cqe->res : -EIO;
+			r->state[i] = BUF_FREE;
+		} else {
+			r->res[i] = cqe->res;
+			r->state[i] = BUF_DONE;
+		}
+		r->inflight--;
+		head++;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* submit what is queued, waiting for 'wait' completions */
+static int uring_submit(struct uring *r, unsigned wait)
+{
+	int ret;
+
+	ret = uring_enter(r, r->queued, wait);
+	if (ret < 0)
+		return ret;
+	r->queued -= ret;
+	r->inflight += ret;
+	uring_reap(r);
+	return 0;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+	unsigned tail = *r->sq_tail, i;
+	struct io_uring_sqe *sqe;
+
+	while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries)
+		uring_submit(r, 0);
+
+	i = tail & *r->sq_mask;
+	sqe = &r->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[i] = i;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+	return sqe;
+}
+
+/* the registered file of fd, registering it on first use */
+static void uring_set_file(struct uring *r, struct io_uring_sqe *sqe, int fd)
+{
+	struct io_uring_files_update up = { 0 };
+	int i, free = -1;
+
+	sqe->fd = fd;
+	if (!r->fixed_files)
+		return;
+	for (i = 0; i < URING_FILES; i++) {
+		if (r->files[i] == fd)
+			break;
+		if (r->files[i] < 0 && free < 0)
+			free = i;
+	}
+	if (i == URING_FILES) {
+		if (free < 0)
+			return;
+		up.offset = i = free;
+		up.fds = (uintptr_t)&fd;
+		if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1) != 1)
+			return;
+		r->files[i] = fd;
+	}
+	sqe->fd = i;
+	sqe->flags |= IOSQE_FIXED_FILE;
+}
+
+void uring_forget(struct uring *r, int fd)
+{
+	struct io_uring_files_update up = { 0 };
+	int i, none = -1;
+
+	for (i = 0; i < URING_FILES; i++) {
+		if (r->files[i] != fd)
+			continue;
+		/* the registration holds a reference, the file wouldn't close */
+		up.offset = i;
+		up.fds = (uintptr_t)&none;
+		syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+		r->files[i] = -1;
+	}
+}
+
+static void uring_prep(struct uring *r, struct io_uring_sqe *sqe, int write, int fd,
+		       int i, size_t len, off_t pos)
+{
+	uring_set_file(r, sqe, fd);
+	if (r->fixed_bufs) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr = (uintptr_t)r->iov[i].iov_base;
+		sqe->len = len;
+		sqe->buf_index = i;
+	} else {
+		sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (uintptr_t)&r->iov[i];
+		sqe->len = 1;
+	}
+	r->iov[i].iov_len = len;
+	sqe->off = pos;
+	sqe->user_data = i;
+	r->state[i] = write ? BUF_WRITE : BUF_READ;
+}
+
+/* a free buffer, waiting for writes to complete if there is none */
+static int uring_buf(struct uring *r)
+{
+	int i, ret;
+
+	while (1) {
+		for (i = 0; i < URING_BUFS; i++)
+			if (r->state[i] == BUF_FREE)
+				return i;
+		ret = uring_submit(r, 1);
+		if (ret)
+			return ret;
+	}
+}
+
+int uring_write(struct uring *r, int fd, const void *buf, size_t len, off_t pos)
+{
+	const uint8_t *p = buf;
+	struct io_uring_sqe *sqe;
+	size_t n;
+	int i;
+
+	while (len) {
+		i = uring_buf(r);
+		if (i < 0)
+			return i;
+		n = len < URING_BUF_SIZE ? len : URING_BUF_SIZE;
+		memcpy(r->iov[i].iov_base, p, n);
+		sqe = uring_sqe(r);
+		uring_prep(r, sqe, 1, fd, i, n, pos);
+		if (!r->batch)
+			uring_submit(r, 0);
+		p += n;
+		pos += n;
+		len -= n;
+	}
+	return r->err;
+}
+
+void uring_batch(struct uring *r)
+{
+	r->batch = 1;
+}
+
+int uring_fsync(struct uring *r, int fd)
+{
+	struct io_uring_sqe *sqe = uring_sqe(r);
+
+	sqe->opcode = IORING_OP_FSYNC;
+	uring_set_file(r, sqe, fd);
+	sqe->user_data = URING_NOBUF;
+	/* after every write before it, a link would only order the last */
+	sqe->flags |= IOSQE_IO_DRAIN;
+	r->batch = 0;
+	return uring_wait(r);
+}
+
+int uring_wait(struct uring *r)
+{
+	int ret;
+
+	while (r->queued || r->inflight) {
+		ret = uring_submit(r, 1);
+		if (ret && !r->err)
+			r->err = ret;
+		if (ret)
+			break;
+	}
+	ret = r->err;
+	r->err = 0;
+	return ret;
+}
+
+int uring_read(struct uring *r, int fd, size_t len, off_t pos)
+{
+	int i;
+
+	if (len > URING_BUF_SIZE)
+		return -EINVAL;
+	i = uring_buf(r);
+	if (i < 0)
+		return i;
+	uring_prep(r, uring_sqe(r), 0, fd, i, len, pos);
+	uring_submit(r, 0);
+	return i;
+}
+
+int uring_read_wait(struct uring *r, int i, void **buf)
+{
+	int ret;
+
+	while (r->state[i] == BUF_READ) {
+		ret = uring_submit(r, 1);
+		if (ret)
+			return ret;
+	}
+	*buf = r->iov[i].iov_base;
+	return r->res[i];
+}
+
+void uring_release(struct uring *r, int i)
+{
+	void *p;
+
+	if (r->state[i] == BUF_READ)
+		uring_read_wait(r, i, &p);
+	r->state[i] = BUF_FREE;
+}
+
+struct uring *uring_open(void)
+{
+	struct io_uring_params params;
+	struct uring *r;
+	int i;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	memset(&params, 0, sizeof(params));
+	r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (r->fd < 0)
+		goto fail;
+	r->entries = params.sq_entries;
+
+	r->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	r->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		r->sq_len = r->cq_len = r->sq_len > r->cq_len ? r->sq_len : r->cq_len;
+	r->sq_ring = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto fail_fd;
+	r->cq_ring = r->sq_ring;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		r->cq_ring = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED)
+			goto fail_sq;
+	}
+	r->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	r->sq_head = (unsigned *)((char *)r->sq_ring + params.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)r->sq_ring + params.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_ring + params.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ring + params.sq_off.array);
+	r->cq_head = (unsigned *)((char *)r->cq_ring + params.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ring + params.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_ring + params.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + params.cq_off.cqes);
+
+	for (i = 0; i < URING_BUFS; i++) {
+		if (posix_memalign(&r->iov[i].iov_base, 4096, URING_BUF_SIZE))
+			goto fail_bufs;
+		r->iov[i].iov_len = URING_BUF_SIZE;
+	}
+	/* both are optional, they only save the kernel some work per request */
+	r->fixed_bufs = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+				r->iov, URING_BUFS) == 0;
+	for (i = 0; i < URING_FILES; i++)
+		r->files[i] = -1;
+	r->fixed_files = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES,
+				 r->files, URING_FILES) == 0;
+
+	printf("io_uring: %u entries, %d x %d kB buffers%s%s\n", r->entries, URING_BUFS,
+	       URING_BUF_SIZE >> 10, r->fixed_bufs ? ", registered" : "",
+	       r->fixed_files ? ", fixed files" : "");
+	return r;
+
+fail_bufs:
+	for (i = 0; i < URING_BUFS; i++)
+		free(r->iov[i].iov_base);
+	munmap(r->sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+fail_cq:
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_len);
+fail_sq:
+	munmap(r->sq_ring, r->sq_len);
+fail_fd:
+	close(r->fd);
+fail:
+	free(r);
+	return NULL;
+}
+
+void uring_close(struct uring *r)
+{
+	int i;
+
+	uring_wait(r);
+	close(r->fd);
+	munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_len);
+	munmap(r->sq_ring, r->sq_len);
+	for (i = 0; i < URING_BUFS; i++)
+		free(r->iov[i].iov_base);
+	free(r);
+}
+#else
+/* headers without io_uring, everything takes the synchronous path */
+struct uring *uring_open(void) { return NULL; }
+void uring_close(struct uring *r) { }
+int uring_write(struct uring *r, int fd, const void *buf, size_t len, off_t pos) { return -ENOSYS; }
+void uring_batch(struct uring *r) { }
+int uring_fsync(struct uring *r, int fd) { return -ENOSYS; }
+int uring_wait(struct uring *r) { return 0; }
+void uring_forget(struct uring *r, int fd) { }
+int uring_read(struct uring *r, int fd, size_t len, off_t pos) { return -ENOSYS; }
+int uring_read_wait(struct uring *r, int idx, void **buf) { return -ENOSYS; }
+void uring_release(struct uring *r, int idx) { }
+#endif
+
+int is_zero(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t v;
+
+	/* 64 bytes per round, bailing out at the first data seen */
+#if defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128(), acc;
+
+	for (; len >= 64; p += 64, len -= 64) {
+		acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)p),
+						_mm_loadu_si128((const __m128i *)(p + 16))),
+				   _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 32)),
+						_mm_loadu_si128((const __m128i *)(p + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+			return 0;
+	}
+#elif defined(__ARM_NEON)
+	uint8x16_t acc;
+	uint64x2_t acc64;
+
+	for (; len >= 64; p += 64, len -= 64) {
+		acc = vorrq_u8(vorrq_u8(vld1q_u8(p), vld1q_u8(p + 16)),
+			       vorrq_u8(vld1q_u8(p + 32), vld1q_u8(p + 48)));
+		acc64 = vreinterpretq_u64_u8(acc);
+		if (vgetq_lane_u64(acc64, 0) | vgetq_lane_u64(acc64, 1))
+			return 0;
+	}
+#endif
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&v, p, 8);
+		if (v)
+			return 0;
+	}
+	while (len--)
+		if (*p++)
+			return 0;
+	return 1;
+}
+
+/* a number from a sysfs attribute of the device, 0 if it has none */
+static uint64_t sysfs_u64(const char *dir, const char *attr)
+{
+	char path[256], line[32];
+	uint64_t v = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (fgets(line, sizeof(line), f))
+		v = strtoull(line, NULL, 0);
+	fclose(f);
+	return v;
+}
+
+/*
+ * The unit writes get aligned to, the largest of the optimal I/O size,
+ * the discard granularity and the card's preferred erase size. Partition
+ * attributes are looked up on the disk.
+ */
+static void blk_sink_align(struct blk_sink *z, dev_t dev)
+{
+	char dir[64], disk[80], link[256], *name;
+	uint64_t opt, gran, erase, unit;
+	ssize_t n;
+
+	snprintf(dir, sizeof(dir), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+	n = readlink(dir, link, sizeof(link) - 1);
+	link[n > 0 ? n : 0] = '\0';
+	name = strrchr(link, '/') ? strrchr(link, '/') + 1 : link;
+
+	if (sysfs_u64(dir, "partition")) {
+		snprintf(disk, sizeof(disk), "%s/..", dir);
+		z->start = sysfs_u64(dir, "start") * 512;
+	} else {
+		snprintf(disk, sizeof(disk), "%s", dir);
+	}
+	opt = sysfs_u64(disk, "queue/optimal_io_size");
+	gran = sysfs_u64(disk, "queue/discard_granularity");
+	erase = sysfs_u64(disk, "device/preferred_erase_size");
+
+	unit = opt > gran ? opt : gran;
+	unit = erase > unit ? erase : unit;
+	if (unit > BLK_MAX_UNIT || unit % z->block || unit <= z->block)
+		unit = 0;
+	if (unit)
+		z->buf = malloc(unit);
+	z->unit = z->buf ? unit : 0;
+
+	printf("%s: block %u, optimal io %llu, discard %llu, erase %llu, "
+	       "writes aligned to %zu at 0x%llx\n", name, z->block,
+	       (unsigned long long)opt, (unsigned long long)gran,
+	       (unsigned long long)erase, z->unit ? z->unit : z->block,
+	       (unsigned long long)z->start);
+}
+
+void blk_sink_init(struct blk_sink *z, int fd)
+{
+	unsigned int zeroes = 0;
+	struct stat st;
+	int block;
+
+	memset(z, 0, sizeof(*z));
+	z->fd = fd;
+	if (fd < 0 || fstat(fd, &st))
+		return;
+	if (S_ISREG(st.st_mode)) {
+		z->seekable = 1;
+		z->block = st.st_blksize;
+		return;
+	}
+	if (!S_ISBLK(st.st_mode) || ioctl(fd, BLKSSZGET, &block) || block <= 0)
+		return;
+
+	z->blk = 1;
+	z->seekable = 1;
+	z->managed = 1;
+	z->elide = 1;
+	z->block = block;
+	/* only kernels before 4.12 ever promise this */
+	if (ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes)
+		z->discard = 1;
+	blk_sink_align(z, st.st_rdev);
+}
+
+static int pwrite_full(int fd, const uint8_t *p, size_t len, off_t pos)
+{
+	ssize_t r;
+
+	while (len) {
+		r = pwrite(fd, p, len, pos);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return r < 0 ? -errno : -EIO;
+		p += r;
+		len -= r;
+		pos += r;
+	}
+	return 0;
+}
+
+/* direct writes need this alignment of the buffer as well */
+#define DIRECT_ALIGN	4096
+#define BOUNCE_SIZE	(1 << 20)
+
+void blk_sink_policy(struct blk_sink *z, uint64_t every, int direct)
+{
+	char path[32];
+	int flags = fcntl(z->fd, F_GETFL);
+
+	if (!z->seekable || flags < 0 || (flags & O_ACCMODE) == O_RDONLY)
+		return;
+
+	z->wb_every = every;
+	if (direct && !z->direct) {
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", z->fd);
+		z->dfd = open(path, O_WRONLY | O_DIRECT | O_CLOEXEC);
+		if (z->dfd >= 0 && posix_memalign((void **)&z->bounce, DIRECT_ALIGN, BOUNCE_SIZE)) {
+			close(z->dfd);
+			z->dfd = -1;
+		}
+		z->direct = z->dfd >= 0;
+	}
+	z->managed = z->blk || z->wb_every || z->direct;
+	if (z->wb_every || z->direct)
+		printf("writeback every %llu kB%s\n", (unsigned long long)every >> 10,
+		       z->direct ? ", direct" : "");
+}
+
+/*
+ * Start writeback of what was written since the last time, wait for the
+ * range started then and drop its pages: there are never more than two
+ * ranges of dirty pages, and what was waited for is on the media.
+ */
+static void blk_writeback(struct blk_sink *z, int all)
+{
+	/* the range has to be in the page cache first */
+	if (z->ring && !z->err)
+		z->err = uring_wait(z->ring);
+	if (z->wb_hi > z->wb_lo &&
+	    sync_file_range(z->fd, z->wb_lo, z->wb_hi - z->wb_lo, SYNC_FILE_RANGE_WRITE)) {
+		z->wb_every = 0;
+		return;
+	}
+	if (z->prev_hi > z->prev_lo) {
+		sync_file_range(z->fd, z->prev_lo, z->prev_hi - z->prev_lo,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+				SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(z->fd, z->prev_lo, z->prev_hi - z->prev_lo, POSIX_FADV_DONTNEED);
+		z->durable += z->prev_hi - z->prev_lo;
+	}
+	z->prev_lo = z->wb_lo;
+	z->prev_hi = z->wb_hi;
+	z->wb_lo = z->wb_hi = 0;
+	if (all && z->prev_hi > z->prev_lo)
+		blk_writeback(z, 0);
+}
+
+/* what went through the page cache, writeback starts once there is enough */
+static void blk_written(struct blk_sink *z, off_t pos, size_t len)
+{
+	if (!z->wb_every)
+		return;
+	/* ranges are contiguous, so nothing is counted twice */
+	if (z->wb_hi > z->wb_lo && pos != z->wb_hi)
+		blk_writeback(z, 0);
+	if (z->wb_hi == z->wb_lo)
+		z->wb_lo = z->wb_hi = pos;
+	z->wb_hi += len;
+	if ((uint64_t)(z->wb_hi - z->wb_lo) >= z->wb_every)
+		blk_writeback(z, 0);
+}
+
+static int blk_pwrite_direct(struct blk_sink *z, const uint8_t *p, size_t len, off_t pos)
+{
+	size_t n;
+	int ret;
+
+	if ((uintptr_t)p % DIRECT_ALIGN == 0)
+		return pwrite_full(z->dfd, p, len, pos);
+
+	for (; len; p += n, pos += n, len -= n) {
+		n = len < BOUNCE_SIZE ? len : BOUNCE_SIZE;
+		memcpy(z->bounce, p, n);
+		ret = pwrite_full(z->dfd, z->bounce, n, pos);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* the data at pos, bypassing the page cache where the policy and alignment allow */
+static int blk_pwrite(struct blk_sink *z, const uint8_t *p, size_t len, off_t pos)
+{
+	int ret;
+
+	if (z->direct && pos % z->block == 0 && len % z->block == 0) {
+		ret = blk_pwrite_direct(z, p, len, pos);
+		if (ret != -EINVAL) {
+			if (!ret)
+				z->durable += len;
+			return ret;
+		}
+		/* the filesystem won't have it after all */
+		close(z->dfd);
+		z->direct = 0;
+	}
+
+	if (z->err)
+		return z->err;
+	if (z->ring)
+		ret = uring_write(z->ring, z->fd, p, len, pos);
+	else
+		ret = pwrite_full(z->fd, p, len, pos);
+	if (!ret)
+		blk_written(z, pos, len);
+	return ret;
+}
+
+/* the next zero run of at least ZERO_MIN_RUN in p, its length in *run */
+static size_t find_zero_run(const uint8_t *p, size_t len, size_t block, size_t *run)
+{
+	size_t i, n;
+
+	for (i = 0; i + block <= len; i += block) {
+		if (!is_zero(p + i, block))
+			continue;
+		for (n = block; i + n + block <= len && is_zero(p + i + n, block); n += block)
+			;
+		if (n >= ZERO_MIN_RUN) {
+			*run = n;
+			return i;
+		}
+		i += n - block;
+	}
+	*run = 0;
+	return len;
+}
+
+/* write at pos, leaving the zero runs to the device */
+static int blk_put(struct blk_sink *z, const uint8_t *p, size_t len, off_t pos)
+{
+	uint64_t range[2];
+	size_t data, run;
+	int ret;
+
+	while (len) {
+		/* unaligned or too short, nothing to elide */
+		if (!z->elide || pos % z->block || len < ZERO_MIN_RUN)
+			data = len, run = 0;
+		else
+			data = find_zero_run(p, len, z->block, &run);
+
+		ret = blk_pwrite(z, p, data, pos);
+		if (ret)
+			return ret;
+		p += data;
+		pos += data;
+		len -= data;
+		if (!run)
+			continue;
+
+		range[0] = pos;
+		range[1] = run;
+		if (ioctl(z->fd, z->discard ? BLKDISCARD : BLKZEROOUT, range) == 0) {
+			z->elided += run;
+			if (z->wb_every || z->direct)
+				z->durable += run;
+		} else {
+			/* not supported after all, write the zeros from now on */
+			z->elide = 0;
+			ret = blk_pwrite(z, p, run, pos);
+			if (ret)
+				return ret;
+		}
+		p += run;
+		pos += run;
+		len -= run;
+	}
+	return 0;
+}
+
+/*
+ * Whole units go straight from the caller's buffer, anything before the
+ * first or after the last unit boundary is kept until the rest of its
+ * unit arrives or the writes stop being sequential.
+ */
+static int blk_coalesce(struct blk_sink *z, const uint8_t *p, size_t len, off_t pos)
+{
+	size_t n, room;
+	int ret;
+
+	if (z->fill && pos != z->buf_pos + (off_t)z->fill) {
+		ret = blk_sink_flush(z);
+		if (ret)
+			return ret;
+	}
+
+	while (len) {
+		if (!z->fill) {
+			if ((z->start + pos) % z->unit == 0 && len >= z->unit) {
+				n = len - len % z->unit;
+				ret = blk_put(z, p, n, pos);
+				if (ret)
+					return ret;
+				p += n;
+				pos += n;
+				len -= n;
+				continue;
+			}
+			z->buf_pos = pos;
+		}
+
+		room = z->unit - (z->start + z->buf_pos + z->fill) % z->unit;
+		n = len < room ? len : room;
+		memcpy(z->buf + z->fill, p, n);
+		z->fill += n;
+		p += n;
+		pos += n;
+		len -= n;
+		if (n == room) {
+			ret = blk_sink_flush(z);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+int blk_sink_write(struct blk_sink *z, const void *buf, size_t len, off_t *off)
+{
+	const uint8_t *p = buf;
+	ssize_t r;
+	off_t pos;
+	int ret;
+
+	/* pipes and the like can't be positioned */
+	if (!z->seekable && !off) {
+		while (len) {
+			r = write(z->fd, p, len);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				return r < 0 ? -errno : -EIO;
+			p += r;
+			len -= r;
+		}
+		return 0;
+	}
+
+	pos = off ? *off : lseek(z->fd, 0, SEEK_CUR);
+	if (pos < 0)
+		return -errno;
+
+	if (z->unit)
+		ret = blk_coalesce(z, p, len, pos);
+	else
+		ret = blk_put(z, p, len, pos);
+
+	/* what is coalesced counts as written */
+	pos += len;
+	if (off)
+		*off = pos;
+	else
+		lseek(z->fd, pos, SEEK_SET);
+	return ret;
+}
+
+int blk_sink_flush(struct blk_sink *z)
+{
+	int ret = 0;
+
+	if (z->fill)
+		ret = blk_put(z, z->buf, z->fill, z->buf_pos);
+	z->fill = 0;
+	return ret;
+}
+
+void blk_sink_ring(struct blk_sink *z, struct uring *r)
+{
+	int flags = fcntl(z->fd, F_GETFL);
+
+	if (!r || !z->seekable || flags < 0 || (flags & O_ACCMODE) == O_RDONLY)
+		return;
+	z->ring = r;
+	z->managed = 1;
+}
+
+int blk_sink_close(struct blk_sink *z)
+{
+	int ret;
+
+	/* the last writes and the fsync go to the kernel together */
+	if (z->ring)
+		uring_batch(z->ring);
+	ret = blk_sink_flush(z);
+	if (z->ring) {
+		if (!ret)
+			ret = z->err;
+		z->err = uring_fsync(z->ring, z->fd);
+		if (!ret)
+			ret = z->err;
+		uring_forget(z->ring, z->fd);
+		z->ring = NULL;
+	}
+	z->err = 0;
+
+	if (z->wb_every)
+		blk_writeback(z, 1);
+	if (z->direct)
+		close(z->dfd);
+	free(z->bounce);
+	free(z->buf);
+	z->buf = z->bounce = NULL;
+	z->unit = 0;
+	z->blk = z->elide = z->seekable = z->managed = z->direct = 0;
+	z->wb_every = 0;
+	z->fd = -1;
+	return ret;
+}
+
+/* erase ioctls are split so progress can be reported, and stopped */
+#define ERASE_CHUNK	(256ULL << 20)
+
+/* the last resort, 1 MB of zeros per call out of a single page */
+static int erase_write(int fd, uint64_t off, uint64_t len,
+		       erase_progress_fn progress, void *arg)
+{
+	static const uint8_t zero[4096];
+	struct iovec iov[256];
+	const size_t max = sizeof(iov) / sizeof(iov[0]) * sizeof(zero);
+	uint64_t done = 0;
+	size_t n;
+	ssize_t r;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		iov[i].iov_base = (void *)zero;
+		iov[i].iov_len = sizeof(zero);
+	}
+	while (done < len) {
+		n = len - done < max ? len - done : max;
+		/* only the last vector is ever short */
+		i = (n + sizeof(zero) - 1) / sizeof(zero);
+		iov[i - 1].iov_len = n - (i - 1) * sizeof(zero);
+		r = pwritev(fd, iov, i, off + done);
+		iov[i - 1].iov_len = sizeof(zero);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return r < 0 ? -errno : -EIO;
+		done += r;
+		if (progress && (done % ERASE_CHUNK < (uint64_t)r || done == len))
+			progress(arg, done, len);
+	}
+	return 0;
+}
+
+/* one block device range ioctl per chunk */
+static int erase_blk(int fd, unsigned long req, uint64_t off, uint64_t len,
+		     erase_progress_fn progress, void *arg)
+{
+	uint64_t range[2], done;
+
+	for (done = 0; done < len; done += range[1]) {
+		range[0] = off + done;
+		range[1] = len - done < ERASE_CHUNK ? len - done : ERASE_CHUNK;
+		if (ioctl(fd, req, range))
+			return -errno;
+		if (progress)
+			progress(arg, done + range[1], len);
+	}
+	return 0;
+}
+
+/* whole erase blocks, bad ones are skipped */
+static int erase_mtd(int fd, struct mtd_info_user *info, uint64_t off, uint64_t len,
+		     erase_progress_fn progress, void *arg)
+{
+	struct erase_info_user64 ei;
+	uint64_t done;
+	loff_t pos;
+
+	if (off % info->erasesize || len % info->erasesize)
+		return -EINVAL;
+
+	for (done = 0; done < len; done += info->erasesize) {
+		pos = off + done;
+		if (ioctl(fd, MEMGETBADBLOCK, &pos) > 0) {
+			printf("erase: skipping bad block at 0x%llx\n", (unsigned long long)pos);
+			continue;
+		}
+		ei.start = pos;
+		ei.length = info->erasesize;
+		if (ioctl(fd, MEMERASE64, &ei))
+			return -errno;
+		if (progress && ((done + ei.length) % ERASE_CHUNK == 0 || done + ei.length == len))
+			progress(arg, done + ei.length, len);
+	}
+	return 0;
+}
+
+int storage_erase(int fd, uint64_t off, uint64_t len, int mode,
+		  erase_progress_fn progress, void *arg, const char **method)
+{
+	struct mtd_info_user info;
+	struct stat st;
+	uint64_t size;
+	int sector, ret;
+
+	*method = "none";
+	if (fstat(fd, &st))
+		return -errno;
+
+	if (S_ISCHR(st.st_mode) && ioctl(fd, MEMGETINFO, &info) == 0) {
+		size = info.size;
+	} else if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, &size))
+			return -errno;
+	} else if (S_ISREG(st.st_mode)) {
+		size = st.st_size;
+	} else {
+		return -ENOTBLK;
+	}
+	if (off > size)
+		return -EINVAL;
+	if (!len || len > size - off)
+		len = size - off;
+	if (!len)
+		return 0;
+
+	if (S_ISCHR(st.st_mode)) {
+		*method = "erase";
+		return erase_mtd(fd, &info, off, len, progress, arg);
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		if (mode == ERASE_SECURE)
+			return -EOPNOTSUPP;
+		/* holes read back as zeros and free the blocks */
+		*method = "punch";
+		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0) {
+			if (progress)
+				progress(arg, len, len);
+			return 0;
+		}
+		*method = "write";
+		return erase_write(fd, off, len, progress, arg);
+	}
+
+	/* range ioctls want whole logical blocks */
+	if (ioctl(fd, BLKSSZGET, &sector) || sector <= 0)
+		sector = 512;
+	if (off % sector || len % sector)
+		return -EINVAL;
+
+	if (mode == ERASE_SECURE) {
+		*method = "secdiscard";
+		return erase_blk(fd, BLKSECDISCARD, off, len, progress, arg);
+	}
+	if (mode == ERASE_DISCARD) {
+		*method = "discard";
+		ret = erase_blk(fd, BLKDISCARD, off, len, progress, arg);
+		if (ret != -EOPNOTSUPP)
+			return ret;
+	}
+	/* the kernel writes the zeros itself if the device can't */
+	*method = "zeroout";
+	ret = erase_blk(fd, BLKZEROOUT, off, len, progress, arg);
+	if (ret != -EOPNOTSUPP && ret != -ENOTTY)
+		return ret;
+	*method = "write";
+	return erase_write(fd, off, len, progress, arg);
+}
+
+static void bench_memory(struct bench_result *res)
+{
+	uint8_t *src, *dst;
+	uint64_t start;
+	volatile uint32_t crc = 0;
+	int i;
+
+	src = malloc(BENCH_MEM_SIZE);
+	dst = malloc(BENCH_MEM_SIZE);
+	if (!src || !dst)
+		goto out;
+
+	memset(src, 0x5a, BENCH_MEM_SIZE);
+	memset(dst, 0, BENCH_MEM_SIZE);
+
+	start = now_us();
+	for (i = 0; i < BENCH_MEM_LOOPS; i++)
+		memcpy(dst, src, BENCH_MEM_SIZE);
+	res->memcpy_rate = kb_per_sec((uint64_t)BENCH_MEM_SIZE * BENCH_MEM_LOOPS,
+				      now_us() - start);
+
+	start = now_us();
+	for (i = 0; i < BENCH_MEM_LOOPS / 2; i++)
+		crc = crc32(crc, dst, BENCH_MEM_SIZE);
+	res->crc32_rate = kb_per_sec((uint64_t)BENCH_MEM_SIZE * (BENCH_MEM_LOOPS / 2),
+				     now_us() - start);
+out:
+	free(src);
+	free(dst);
+}
+
+/*
+ * Sequential and random reads, each followed by writing the very same
+ * data back when 'rw' is set, so the content of the device is kept.
+ */
+static void bench_fd(struct bench_target *t, int fd, size_t size, int rw)
+{
+	uint64_t rd_us = 0, wr_us = 0, start;
+	size_t chunk = size < BENCH_SEQ_CHUNK ? size : BENCH_SEQ_CHUNK;
+	unsigned int seed = 1;
+	uint64_t blocks;
+	off_t off;
+	void *buf;
+	int i;
+
+	if (posix_memalign(&buf, 4096, chunk))
+		return;
+
+	for (off = 0; off + chunk <= size; off += chunk) {
+		start = now_us();
+		if (pread(fd, buf, chunk, off) != chunk)
+			goto out;
+		rd_us += now_us() - start;
+
+		if (rw) {
+			start = now_us();
+			if (pwrite(fd, buf, chunk, off) != chunk)
+				rw = 0;
+			else if (fdatasync(fd) && errno != EINVAL)
+				rw = 0;
+			wr_us += now_us() - start;
+		}
+	}
+	t->seq_read = kb_per_sec(off, rd_us);
+	if (rw)
+		t->seq_write = kb_per_sec(off, wr_us);
+
+	blocks = t->size / BENCH_RAND_BLOCK;
+	if (!blocks)
+		goto out;
+
+	rd_us = wr_us = 0;
+	for (i = 0; i < BENCH_RAND_COUNT; i++) {
+		off = (rand_r(&seed) % blocks) * BENCH_RAND_BLOCK;
+
+		start = now_us();
+		if (pread(fd, buf, BENCH_RAND_BLOCK, off) != BENCH_RAND_BLOCK)
+			goto out;
+		rd_us += now_us() - start;
+
+		if (rw) {
+			start = now_us();
+			if (pwrite(fd, buf, BENCH_RAND_BLOCK, off) != BENCH_RAND_BLOCK ||
+			    (fdatasync(fd) && errno != EINVAL))
+				rw = 0;
+			wr_us += now_us() - start;
+		}
+	}
+	t->rand_read = (uint64_t)BENCH_RAND_COUNT * 1000000 / (rd_us ? rd_us : 1);
+	if (rw)
+		t->rand_write = (uint64_t)BENCH_RAND_COUNT * 1000000 / (wr_us ? wr_us : 1);
+out:
+	free(buf);
+}
+
+/* whether the disk or one of its partitions is mounted */
+static int disk_mounted(const char *name)
+{
+	char path[128], devs[64][16], line[512], id[16];
+	struct dirent *d;
+	int n = 0, i, mounted = 0;
+	FILE *f;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/sys/block/%s", name);
+	dir = opendir(path);
+	if (!dir)
+		return 1;
+	while ((d = readdir(dir)) && n < 64) {
+		if (strcmp(d->d_name, ".") == 0)
+			snprintf(path, sizeof(path), "/sys/block/%s/dev", name);
+		else if (strncmp(d->d_name, name, strlen(name)) == 0)
+			snprintf(path, sizeof(path), "/sys/block/%s/%.64s/dev", name, d->d_name);
+		else
+			continue;
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%15s", devs[n]) == 1)
+			n++;
+		fclose(f);
+	}
+	closedir(dir);
+
+	/* the third field of mountinfo is the major:minor of the source */
+	f = fopen("/proc/self/mountinfo", "r");
+	if (!f)
+		return 1;
+	while (!mounted && fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%*s %*s %15s", id) != 1)
+			continue;
+		for (i = 0; i < n; i++)
+			if (strcmp(id, devs[i]) == 0)
+				mounted = 1;
+	}
+	fclose(f);
+	return mounted;
+}
+
+static void bench_block(struct bench_target *t, size_t size, int rw)
+{
+	char dev[64];
+	int fd, ro = 0;
+
+	snprintf(dev, sizeof(dev), "/dev/%s", t->name);
+
+	/* a filesystem could change a block between our read and write back */
+	if (rw && disk_mounted(t->name)) {
+		printf("selftest: %s is mounted, only reading\n", t->name);
+		rw = 0;
+	}
+
+	/* bypass the page cache, not every driver supports it though */
+	fd = open(dev, (rw ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (fd < 0 && rw) {
+		rw = 0;
+		fd = open(dev, O_RDONLY | O_DIRECT);
+	}
+	if (fd < 0)
+		fd = open(dev, rw ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		printf("selftest: can't open %s: %s\n", dev, strerror(errno));
+		return;
+	}
+
+	if (ioctl(fd, BLKGETSIZE64, &t->size) < 0 || !t->size)
+		goto out;
+	if (ioctl(fd, BLKROGET, &ro) == 0 && ro)
+		rw = 0;
+
+	if (size > t->size)
+		size = t->size;
+	posix_fadvise(fd, 0, size, POSIX_FADV_DONTNEED);
+	bench_fd(t, fd, size, rw);
+out:
+	close(fd);
+}
+
+static void bench_mtd(struct bench_target *t, size_t size)
+{
+	struct mtd_info_user info;
+	char dev[64];
+	int fd;
+
+	snprintf(dev, sizeof(dev), "/dev/%s", t->name);
+	fd = open(dev, O_RDONLY);
+	if (fd < 0) {
+		printf("selftest: can't open %s: %s\n", dev, strerror(errno));
+		return;
+	}
+
+	if (ioctl(fd, MEMGETINFO, &info) == 0) {
+		t->size = info.size;
+		if (size > t->size)
+			size = t->size;
+		/* writing would need an erase, so MTD is only read */
+		bench_fd(t, fd, size, 0);
+	}
+	close(fd);
+}
+
+static int target_cmp(const void *a, const void *b)
+{
+	const struct bench_target *x = a, *y = b;
+	int r = strcmp(x->type, y->type);
+
+	return r ? r : strcmp(x->name, y->name);
+}
+
+/* collect the eMMC/SD disks, their boot partitions and MTD devices */
+static void find_targets(struct bench_result *res)
+{
+	struct bench_target *t;
+	struct dirent *d;
+	DIR *dir;
+	int n, len;
+
+	dir = opendir("/sys/block");
+	while (dir && (d = readdir(dir)) && res->count < BENCH_MAX_TARGETS) {
+		if (strncmp(d->d_name, "mmcblk", 6) || strstr(d->d_name, "rpmb"))
+			continue;
+		t = &res->target[res->count++];
+		snprintf(t->name, sizeof(t->name), "%.31s", d->d_name);
+		strcpy(t->type, "blk");
+	}
+	if (dir)
+		closedir(dir);
+
+	dir = opendir("/sys/class/mtd");
+	while (dir && (d = readdir(dir)) && res->count < BENCH_MAX_TARGETS) {
+		/* skip the mtdXro aliases */
+		if (sscanf(d->d_name, "mtd%d%n", &n, &len) != 1 || d->d_name[len])
+			continue;
+		t = &res->target[res->count++];
+		snprintf(t->name, sizeof(t->name), "%.31s", d->d_name);
+		strcpy(t->type, "mtd");
+	}
+	if (dir)
+		closedir(dir);
+
+	qsort(res->target, res->count, sizeof(res->target[0]), target_cmp);
+}
+
+int storage_selftest(struct bench_result *res, size_t size, int rw)
+{
+	struct bench_target *t;
+	int i;
+
+	memset(res, 0, sizeof(*res));
+	if (!size)
+		size = BENCH_DEFAULT_SIZE;
+
+	bench_memory(res);
+	find_targets(res);
+
+	for (i = 0; i < res->count; i++) {
+		t = &res->target[i];
+		printf("selftest: %s\n", t->name);
+		if (strcmp(t->type, "mtd") == 0)
+			bench_mtd(t, size);
+		else
+			bench_block(t, size, rw);
+	}
+
+	return 0;
+}
@@ -0,0 +1,202 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Storage helpers shared by the uuc and ufb daemons
+ *
+ * Copyright (C) 2024 NXP
+ */
+#ifndef __STORAGE_H
+#define __STORAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* default amount of data moved by each storage benchmark */
+#define BENCH_DEFAULT_SIZE	(4 << 20)
+
+/* block size and count of the random access benchmarks */
+#define BENCH_RAND_BLOCK	4096
+#define BENCH_RAND_COUNT	256
+
+#define BENCH_MAX_TARGETS	16
+
+/*
+ * Result of benchmarking one storage target. Sequential rates are in
+ * kB/s, random rates in 4 kB operations per second, 0 means not measured.
+ */
+struct bench_target {
+	char name[32];		/* mmcblk0, mmcblk0boot0, mtd0, ... */
+	char type[4];		/* "blk" or "mtd" */
+	uint64_t size;		/* bytes */
+	uint32_t seq_read;
+	uint32_t seq_write;
+	uint32_t rand_read;
+	uint32_t rand_write;
+};
+
+struct bench_result {
+	uint32_t memcpy_rate;	/* kB/s */
+	uint32_t crc32_rate;	/* kB/s */
+	int count;
+	struct bench_target target[BENCH_MAX_TARGETS];
+};
+
+/*
+ * Transfer size tuning: the size doubles while the measured throughput
+ * keeps improving and halves again when it drops.
+ */
+struct xfer_tuner {
+	size_t size;		/* current recommendation */
+	size_t min, max;
+	uint32_t rate;		/* kB/s of the last complete window */
+	uint64_t bytes, us;	/* current window */
+};
+
+void tuner_init(struct xfer_tuner *t, size_t min, size_t max, size_t size);
+void tuner_update(struct xfer_tuner *t, uint64_t bytes, uint64_t us);
+
+/* MemAvailable from /proc/meminfo, in bytes */
+uint64_t mem_available(void);
+
+/* largest power of two transfer buffer that fits in a quarter of free memory */
+size_t max_buffer_size(size_t limit);
+
+uint64_t now_us(void);
+uint32_t kb_per_sec(uint64_t bytes, uint64_t us);
+uint32_t crc32(uint32_t crc, const void *buf, size_t len);
+
+struct sha256_ctx {
+	uint32_t h[8];
+	uint64_t len;		/* bytes hashed */
+	uint8_t buf[64];
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[32]);
+
+/*
+ * io_uring storage I/O: writes are copied into registered buffers and
+ * several are in flight, reads are started ahead of their use. Only for
+ * one thread at a time. uring_open() returns NULL when the kernel
+ * doesn't support it, errors of writes are returned by later calls.
+ */
+#define URING_BUFS	8
+#define URING_BUF_SIZE	(512 << 10)
+
+struct uring;
+
+struct uring *uring_open(void);
+void uring_close(struct uring *r);
+int uring_write(struct uring *r, int fd, const void *buf, size_t len, off_t pos);
+/* hold back the writes that follow, uring_fsync() submits them with it */
+void uring_batch(struct uring *r);
+int uring_fsync(struct uring *r, int fd);
+/* wait for everything in flight, returns and clears the first error */
+int uring_wait(struct uring *r);
+/* before fd is closed */
+void uring_forget(struct uring *r, int fd);
+/* start a read, returns the buffer it goes to or -errno */
+int uring_read(struct uring *r, int fd, size_t len, off_t pos);
+/* the data of a read, bytes read or -errno; the buffer stays taken */
+int uring_read_wait(struct uring *r, int idx, void **buf);
+void uring_release(struct uring *r, int idx);
+
+/* whether a buffer is all zeros, vectorised where the CPU allows */
+int is_zero(const void *buf, size_t len);
+
+/*
+ * Writes to a target. On a block device, block aligned runs of zeros
+ * become BLKZEROOUT, or BLKDISCARD where discarded blocks read back as
+ * zeros, and sequential data is coalesced into writes aligned to the
+ * erase/allocation unit sysfs reports, so the card's FTL doesn't have
+ * to read-modify-write. Other targets get plain writes, unless a
+ * writeback policy is set: then writeback is started every so many
+ * bytes and the pages written are dropped once on the media, or the
+ * data bypasses the page cache altogether.
+ */
+struct blk_sink {
+	int fd;
+	int blk;		/* block device */
+	int seekable;		/* block device or regular file */
+	int managed;		/* writes have to go through the sink */
+	int elide;		/* zero runs go to the device */
+	unsigned int block;	/* logical block size */
+	int discard;		/* BLKDISCARD reads back zeros */
+	size_t unit;		/* writes aligned to this, 0 when not coalescing */
+	off_t start;		/* of the partition on its disk */
+	uint8_t *buf;		/* up to the next unit boundary */
+	size_t fill;
+	off_t buf_pos;		/* where buf goes */
+	uint64_t elided;	/* bytes not written */
+
+	int direct;		/* dfd is open */
+	int dfd;		/* O_DIRECT twin of fd */
+	uint8_t *bounce;	/* aligned copy of unaligned buffers */
+	uint64_t wb_every;	/* start writeback every so many bytes, 0 never */
+	off_t wb_lo, wb_hi;	/* written since writeback was last started */
+	off_t prev_lo, prev_hi;	/* writeback started, not waited for */
+	uint64_t durable;	/* bytes known to be on the media */
+
+	struct uring *ring;	/* buffered writes go through it */
+	int err;		/* of a write on the ring */
+};
+
+/* zero runs shorter than this aren't worth an ioctl */
+#define ZERO_MIN_RUN	(64 << 10)
+
+/* larger units aren't coalesced to, the data is written as it comes */
+#define BLK_MAX_UNIT	(16 << 20)
+
+/* logs the alignment for block devices */
+void blk_sink_init(struct blk_sink *z, int fd);
+
+/*
+ * Start writeback every 'every' bytes, waiting for the previous range
+ * and dropping it from the page cache, and/or write with O_DIRECT what
+ * is aligned enough. Only for writable files and block devices.
+ */
+void blk_sink_policy(struct blk_sink *z, uint64_t every, int direct);
+
+/* queue the buffered writes on r, blk_sink_close() then fsyncs */
+void blk_sink_ring(struct blk_sink *z, struct uring *r);
+
+/* at *off and advancing it, or at the file position; 0 or -errno */
+int blk_sink_write(struct blk_sink *z, const void *buf, size_t len, off_t *off);
+
+/* write what is still coalesced; 0 or the error of that write */
+int blk_sink_flush(struct blk_sink *z);
+
+/* flush and forget the target, elided is kept; returns the flush error */
+int blk_sink_close(struct blk_sink *z);
+
+/*
+ * Erase modes. ERASE_ZERO leaves zeros (0xff on MTD), ERASE_DISCARD
+ * takes the cheapest way and leaves whatever the device reads back,
+ * ERASE_SECURE fails rather than leave the old data recoverable.
+ */
+#define ERASE_ZERO	0
+#define ERASE_DISCARD	1
+#define ERASE_SECURE	2
+
+/* bytes done so far out of total, called between chunks */
+typedef void (*erase_progress_fn)(void *arg, uint64_t done, uint64_t total);
+
+/*
+ * Erase len bytes at off, up to the end when len is 0, with discard,
+ * secure discard, zeroout or MEMERASE, whatever the target supports,
+ * and zero writes when it supports none. How it was done is returned
+ * in *method. 0 or -errno.
+ */
+int storage_erase(int fd, uint64_t off, uint64_t len, int mode,
+		  erase_progress_fn progress, void *arg, const char **method);
+
+/*
+ * Benchmark memory, hashing and every eMMC/SD (user area and boot
+ * partitions) and MTD device, reading only unless 'rw' is set. Writes
+ * put back the data just read, and are skipped on read-only devices,
+ * MTD and disks with a mounted partition.
+ */
+int storage_selftest(struct bench_result *res, size_t size, int rw);
+
+#endif
@@ -0,0 +1,248 @@
+#!/bin/sh
+#
+# Regression tests and benchmark for sdimage, run against image files so
+# no SD card or root access is needed:
+#
+#	tests/sdimage.sh [--bench] [path/to/sdimage]
+#
+# BCB fields are read with od, so a little endian host is assumed.
+
+bench=0
+if [ "$1" = "--bench" ]; then
+	bench=1
+	shift
+fi
+
+SDIMAGE=$(cd "$(dirname "${1:-./sdimage}")" && pwd)/$(basename "${1:-./sdimage}")
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+cd "$TMP" || exit 1
+
+pass=0
+fail=0
+
+ok() {
+	pass=$((pass + 1))
+	echo "PASS: $*"
+}
+
+nok() {
+	fail=$((fail + 1))
+	echo "FAIL: $*"
+}
+
+# mkimage <file> <partition start> <partition sectors> <image sectors>
+# image with an MBR holding a single bootstream (type 'S') partition
+mkimage() {
+	rm -f "$1"
+	dd if=/dev/zero of="$1" bs=512 count=0 seek="$4" 2>/dev/null
+	{
+		dd if=/dev/zero bs=446 count=1 2>/dev/null
+		printf '\000\000\000\000S\000\000\000'
+		le32 "$2"
+		le32 "$3"
+		dd if=/dev/zero bs=48 count=1 2>/dev/null
+		printf '\125\252'
+	} | dd of="$1" conv=notrunc 2>/dev/null
+}
+
+# print a 32 bit value as little endian bytes
+le32() {
+	printf "$(printf '\\%03o\\%03o\\%03o\\%03o' \
+		$(($1 & 255)) $((($1 >> 8) & 255)) $((($1 >> 16) & 255)) $((($1 >> 24) & 255)))"
+}
+
+# mkfw <file> <bytes>
+mkfw() {
+	head -c "$2" /dev/urandom > "$1"
+}
+
+# u32 <file> <byte offset>
+u32() {
+	od -An -tu4 -j "$2" -N 4 "$1" | tr -d ' '
+}
+
+round_up() {
+	echo $((($1 + $2 - 1) / $2 * $2))
+}
+
+# check_install <image> <firmware> <partition start> <alignment kB>
+# validate the BCB against sdimage's layout rules and both copies byte for byte
+check_install() {
+	img=$1 fw=$2 start=$3 align=$4
+	size=$(wc -c < "$fw")
+	bcb=$((start * 512))
+
+	offset=$((4 * 512 + size))
+	if [ "$align" -gt 0 ]; then
+		offset=$(round_up $offset $((align * 1024)))
+	else
+		offset=$(round_up $offset 512)
+	fi
+	first=$((start + 4))
+	count0=$((offset / 512 - 4))
+	second=$((first + count0))
+	count1=$(((size + 511) / 512))
+
+	expect="1122867 1 2 2 0 0 1 $first $count0 0 0 2 $second $count1"
+	got=""
+	for i in 0 1 2 3 4 5 6 7 8 9 10 11 12 13; do
+		got="$got $(u32 "$img" $((bcb + i * 4)))"
+	done
+	if [ "$got" != " $expect" ]; then
+		echo "  BCB: expected '$expect', got '$got'"
+		return 1
+	fi
+
+	for sector in $first $second; do
+		dd if="$img" of=copy bs=512 skip="$sector" count="$count1" 2>/dev/null
+		if ! cmp -s -n "$size" "$fw" copy; then
+			echo "  firmware copy at sector $sector differs"
+			return 1
+		fi
+	done
+	return 0
+}
+
+# mincount <firmware bytes> <alignment kB>: smallest bootstream partition
+mincount() {
+	offset=$((4 * 512 + $1))
+	if [ "$2" -gt 0 ]; then
+		offset=$(round_up $offset $(($2 * 1024)))
+	else
+		offset=$(round_up $offset 512)
+	fi
+	echo $(((offset + $1 + 511) / 512))
+}
+
+if [ $bench -eq 1 ]; then
+	# ms <command...>: run and print the elapsed milliseconds
+	ms() {
+		t0=$(date +%s%N)
+		"$@" > /dev/null || echo "  '$*' failed" >&2
+		echo $((($(date +%s%N) - t0) / 1000000))
+	}
+
+	for mb in 16 64 256; do
+		mkfw fw.bin $((mb * 1024 * 1024))
+		mkimage disk.img 2048 $((mb * 2 * 2048 + 8192)) $((mb * 2 * 2048 + 16384))
+		sync
+
+		t=$(ms "$SDIMAGE" -f fw.bin disk.img)
+		echo "install     ${mb} MB: $t ms, $((2 * mb * 1000 / (t + 1))) MB/s"
+		t=$(ms "$SDIMAGE" -s -f fw.bin disk.img)
+		echo "unchanged   ${mb} MB: $t ms"
+		t=$(ms "$SDIMAGE" -V -f fw.bin disk.img)
+		echo "verify      ${mb} MB: $t ms"
+		t=$(ms sh -c "cat fw.bin | '$SDIMAGE' -f - -S $((mb * 1024 * 1024)) disk.img")
+		echo "stream      ${mb} MB: $t ms"
+		cp disk.img disk2.img
+		t=$(ms "$SDIMAGE" -f fw.bin disk.img disk2.img)
+		echo "gang x2     ${mb} MB: $t ms"
+		t=$(ms "$SDIMAGE" -c 4G -f fw.bin card.img)
+		echo "create 4G   ${mb} MB: $t ms, $(du -k card.img | cut -f1) kB allocated"
+		rm -f disk.img disk2.img card.img
+	done
+	exit 0
+fi
+
+# layout and content for a range of firmware sizes and alignments
+for align in 0 1 4 64 128; do
+	for size in 1 511 512 513 65536 300001; do
+		mkimage disk.img 2048 8192 12288
+		mkfw fw.bin $size
+		if "$SDIMAGE" -a $align -f fw.bin disk.img > log 2>&1 &&
+		   check_install disk.img fw.bin 2048 $align; then
+			ok "alignment $align kB, firmware $size bytes"
+		else
+			cat log
+			nok "alignment $align kB, firmware $size bytes"
+		fi
+	done
+done
+
+# partition sized exactly to the minimum, and one sector less
+for align in 0 64; do
+	mkfw fw.bin 100000
+	min=$(mincount 100000 $align)
+	mkimage disk.img 63 $min $((min + 63))
+	if "$SDIMAGE" -a $align -f fw.bin disk.img > log 2>&1 &&
+	   check_install disk.img fw.bin 63 $align; then
+		ok "minimum partition of $min sectors, alignment $align kB"
+	else
+		cat log
+		nok "minimum partition of $min sectors, alignment $align kB"
+	fi
+	mkimage disk.img 63 $((min - 1)) $((min + 63))
+	if "$SDIMAGE" -a $align -f fw.bin disk.img > log 2>&1; then
+		nok "partition of $((min - 1)) sectors accepted, alignment $align kB"
+	else
+		ok "partition of $((min - 1)) sectors rejected, alignment $align kB"
+	fi
+done
+
+# no partition table, no bootstream partition
+mkfw fw.bin 1000
+dd if=/dev/zero of=disk.img bs=512 count=4096 2>/dev/null
+if "$SDIMAGE" -f fw.bin disk.img > log 2>&1; then
+	nok "image without MBR accepted"
+else
+	ok "image without MBR rejected"
+fi
+
+# --skip-identical writes nothing the second time, --verify passes
+mkfw fw.bin 200000
+mkimage disk.img 2048 8192 12288
+"$SDIMAGE" -f fw.bin disk.img > /dev/null 2>&1
+if "$SDIMAGE" -v -s -V -f fw.bin disk.img > log 2>&1 &&
+   [ "$(grep -c 'ok, 0 of' log)" -eq 3 ] && check_install disk.img fw.bin 2048 64; then
+	ok "skip identical"
+else
+	cat log
+	nok "skip identical"
+fi
+
+# several devices at once
+mkimage a.img 2048 8192 12288
+cp a.img b.img
+cp a.img c.img
+if "$SDIMAGE" -f fw.bin -d a.img b.img c.img > log 2>&1 &&
+   check_install a.img fw.bin 2048 64 && check_install b.img fw.bin 2048 64 &&
+   check_install c.img fw.bin 2048 64; then
+	ok "gang programming"
+else
+	cat log
+	nok "gang programming"
+fi
+
+# firmware from a pipe, with and without a declared size
+for opt in "" "-S 200000"; do
+	mkimage disk.img 2048 8192 12288
+	if cat fw.bin | "$SDIMAGE" -V -f - $opt disk.img > log 2>&1 &&
+	   check_install disk.img fw.bin 2048 64; then
+		ok "stdin firmware $opt"
+	else
+		cat log
+		nok "stdin firmware $opt"
+	fi
+done
+mkimage disk.img 2048 8192 12288
+if cat fw.bin | "$SDIMAGE" -f - -S 300000 disk.img > log 2>&1; then
+	nok "short firmware stream accepted"
+else
+	ok "short firmware stream rejected"
+fi
+
+# new sparse image
+if "$SDIMAGE" -c 1G -f fw.bin card.img > log 2>&1 &&
+   [ "$(wc -c < card.img)" -eq 1073741824 ] &&
+   [ "$(du -k card.img | cut -f1)" -lt 1024 ] &&
+   check_install card.img fw.bin 2048 64; then
+	ok "create sparse image"
+else
+	cat log
+	nok "create sparse image"
+fi
+
+echo "$pass passed, $fail failed"
+[ $fail -eq 0 ]
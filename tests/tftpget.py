@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+#
+# Fetch files with tftpget from a small TFTP server on loopback:
+#
+#	tests/tftpget.py [path/to/tftpget]
+#
+# The server supports blksize, windowsize (RFC 7440) and tsize, can act
+# as a plain RFC 1350 server, and can drop packets to exercise recovery.
+
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+TFTPGET = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "./tftpget")
+
+
+class Server(threading.Thread):
+    def __init__(self, root, options=True, drop=()):
+        super().__init__(daemon=True)
+        self.root = root
+        self.options = options
+        self.drop = set(drop)   # block numbers lost on their first send
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind(("127.0.0.1", 0))
+        self.port = self.sock.getsockname()[1]
+        self.acks = 0
+
+    def run(self):
+        pkt, client = self.sock.recvfrom(1024)
+        fields = pkt[2:].split(b"\0")
+        name = fields[0].decode()
+        opts = {fields[i].decode().lower(): fields[i + 1].decode()
+                for i in range(2, len(fields) - 1, 2)}
+        data = open(os.path.join(self.root, name), "rb").read()
+
+        s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        s.bind(("127.0.0.1", 0))
+        s.settimeout(0.5)
+
+        blksize, window = 512, 1
+        if self.options and opts:
+            blksize = int(opts.get("blksize", 512))
+            window = int(opts.get("windowsize", 1))
+            oack = b"\0\6"
+            for k, v in (("blksize", blksize), ("windowsize", window),
+                         ("tsize", len(data))):
+                if k in opts:
+                    oack += k.encode() + b"\0" + str(v).encode() + b"\0"
+            for _ in range(5):
+                s.sendto(oack, client)
+                try:
+                    ack, _ = s.recvfrom(1024)
+                except socket.timeout:
+                    continue
+                if ack[:4] == b"\0\4\0\0":
+                    break
+
+        blocks = len(data) // blksize + 1
+        acked = 0
+        while acked < blocks:
+            for b in range(acked + 1, min(acked + window, blocks) + 1):
+                if b in self.drop:
+                    self.drop.discard(b)
+                    continue
+                chunk = data[(b - 1) * blksize:b * blksize]
+                s.sendto(struct.pack(">HH", 3, b & 0xffff) + chunk, client)
+            try:
+                ack, _ = s.recvfrom(1024)
+            except socket.timeout:
+                continue
+            self.acks += 1
+            op, n = struct.unpack(">HH", ack[:4])
+            # block numbers roll over, find the one just below the window
+            base = acked & ~0xffff
+            n += base
+            if n < acked:
+                n += 0x10000
+            if op == 4 and n >= acked:
+                acked = n
+
+
+passed = failed = 0
+
+
+def check(name, ok):
+    global passed, failed
+    if ok:
+        passed += 1
+        print("PASS:", name)
+    else:
+        failed += 1
+        print("FAIL:", name)
+
+
+def fetch(tmp, size, args=(), **kw):
+    src = os.path.join(tmp, "src.bin")
+    dst = os.path.join(tmp, "dst.bin")
+    data = os.urandom(size)
+    open(src, "wb").write(data)
+    if os.path.exists(dst):
+        os.unlink(dst)
+
+    srv = Server(tmp, **kw)
+    srv.start()
+    t0 = time.time()
+    r = subprocess.run([TFTPGET, "-p", str(srv.port)] + list(args) +
+                       ["127.0.0.1", "src.bin", dst],
+                       stdout=subprocess.PIPE, timeout=60)
+    elapsed = time.time() - t0
+    ok = r.returncode == 0 and open(dst, "rb").read() == data
+    if not ok:
+        sys.stdout.write(r.stdout.decode())
+    return ok, srv.acks, elapsed
+
+
+def main():
+    tmp = tempfile.mkdtemp()
+    try:
+        ok, acks, _ = fetch(tmp, 1000000)
+        check("window 16 blksize 8192, %d acks" % acks, ok and acks < 20)
+        ok, acks, _ = fetch(tmp, 1000000, ["-b", "1468", "-w", "4"])
+        check("window 4 blksize 1468, %d acks" % acks, ok)
+        ok, acks, _ = fetch(tmp, 8192 * 16)
+        check("exact multiple of blksize", ok)
+        ok, acks, _ = fetch(tmp, 0)
+        check("empty file", ok)
+        ok, acks, _ = fetch(tmp, 200000, options=False)
+        check("server without options", ok and acks == 200000 // 512 + 1)
+        ok, acks, _ = fetch(tmp, 1000000, drop=(3, 40, 41, 122))
+        check("lost blocks", ok)
+        ok, acks, _ = fetch(tmp, 512 * 70000, ["-b", "512", "-w", "64"])
+        check("block number rollover", ok)
+        ok, _, elapsed = fetch(tmp, 64 << 20, ["-b", "65464", "-w", "32"])
+        check("64 MB in %.2f s" % elapsed, ok)
+
+        # nothing is left behind when the server goes away
+        src = os.path.join(tmp, "src.bin")
+        dst = os.path.join(tmp, "dst.bin")
+        if os.path.exists(dst):
+            os.unlink(dst)
+        s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        s.bind(("127.0.0.1", 0))
+        r = subprocess.run([TFTPGET, "-p", str(s.getsockname()[1]),
+                            "127.0.0.1", "src.bin", dst],
+                           stdout=subprocess.PIPE, timeout=60)
+        check("no server", r.returncode != 0 and not os.path.exists(dst) and
+              not os.path.exists(dst + ".part"))
+    finally:
+        subprocess.call(["rm", "-rf", tmp])
+
+    print("%d passed, %d failed" % (passed, failed))
+
+
+main()
+sys.exit(1 if failed else 0)
@@ -0,0 +1,516 @@
+#!/usr/bin/env python3
+#
+# Exercise the ufb TCP transport on loopback:
+#
+#	tests/ufb-tcp.py [path/to/ufb]
+#
+# Every message in either direction is preceded by its length, 32 bit
+# little endian; the frames are the ones ufb uses over USB. The USB only
+# paths (pipeline, handle writers) are run with FIFOs for the endpoints.
+
+import os
+import select
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import gzip
+import hashlib
+import time
+import zlib
+
+UFB = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "./ufb")
+PORT = 17000 + os.getpid() % 1000
+
+
+class Session:
+    def __init__(self, port=PORT, host="127.0.0.1"):
+        self.sock = socket.create_connection((host, port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+    def send(self, data):
+        if isinstance(data, str):
+            data = data.encode()
+        self.sock.sendall(struct.pack("<I", len(data)) + data)
+
+    def recv_exact(self, n):
+        buf = bytearray()
+        while len(buf) < n:
+            chunk = self.sock.recv(n - len(buf))
+            if not chunk:
+                raise EOFError("connection closed")
+            buf += chunk
+        return bytes(buf)
+
+    def recv(self):
+        (n,) = struct.unpack("<I", self.recv_exact(4))
+        return self.recv_exact(n)
+
+    def status(self):
+        """skip INFO frames, return (key, data, info lines)"""
+        info = []
+        while True:
+            m = self.recv()
+            if m[:4] != b"INFO":
+                return m[:4].decode(), m[4:].decode(errors="replace"), info
+            if len(m) > 4:
+                info.append(m[4:].decode(errors="replace"))
+
+    def cmd(self, c):
+        self.send(c)
+        return self.status()
+
+    def download(self, data, offset=None, handle=None, crc=None):
+        c = "donwload:%08X" % len(data)
+        if offset is not None:
+            c += "@%X" % offset
+        if handle is not None:
+            c += "#" + handle
+        if crc is not None:
+            c += "%%%X" % crc
+        self.send(c)
+        key, size, _ = self.status()
+        assert key == "DATA" and int(size, 16) == len(data), (key, size)
+        self.send(data)
+        key, self.reply, _ = self.status()
+        return key
+
+    def close(self):
+        self.sock.close()
+
+
+class FifoSession(Session):
+    """ufb on <dir>/ep0, ep1 and ep2 being FIFOs in place of the bulk endpoints"""
+
+    def __init__(self, ep0):
+        ep = os.path.dirname(ep0)
+        self.sink = os.open(os.path.join(ep, "ep1"), os.O_RDONLY)
+        self.source = os.open(os.path.join(ep, "ep2"), os.O_WRONLY)
+        self.buf = b""
+
+    def send(self, data):
+        if isinstance(data, str):
+            data = data.encode()
+        # atomic writes, ufb reads a transfer at a time
+        for i in range(0, len(data), 4096):
+            os.write(self.source, data[i:i + 4096])
+
+    def recv(self):
+        """frames run together, wait for the answer and drop what was before"""
+        while True:
+            idle = not select.select([self.sink], [], [], 0.05)[0]
+            if idle:
+                i = max(self.buf.rfind(k) for k in (b"OKAY", b"FAIL", b"DATA"))
+                if i >= 0:
+                    m, self.buf = self.buf[i:], b""
+                    return m
+                if not select.select([self.sink], [], [], 5)[0]:
+                    raise EOFError("no answer")
+            chunk = os.read(self.sink, 4096)
+            if not chunk:
+                raise EOFError("ufb gone")
+            self.buf += chunk
+
+    def close(self):
+        os.close(self.sink)
+        os.close(self.source)
+
+
+passed = failed = 0
+
+
+def check(name, ok):
+    global passed, failed
+    if ok:
+        passed += 1
+        print("PASS:", name)
+    else:
+        failed += 1
+        print("FAIL:", name)
+
+
+def start(args, port=PORT, addr=""):
+    """run ufb, returns it and a session once it listens"""
+    ufb = subprocess.Popen([UFB] + args + ["tcp:%s%d" % (addr, port)],
+                           stdout=subprocess.DEVNULL)
+    for _ in range(100):
+        try:
+            return ufb, Session(port)
+        except ConnectionRefusedError:
+            time.sleep(0.05)
+    ufb.kill()
+    ufb.wait()
+    raise RuntimeError("ufb not listening")
+
+
+def sparse_image(blocks):
+    """Android sparse image of ("raw", data) / ("fill", u32, n) / ("skip", n)"""
+    chunks = b""
+    total = 0
+    for c in blocks:
+        if c[0] == "raw":
+            n = len(c[1]) // 4096
+            chunks += struct.pack("<HHII", 0xcac1, 0, n, 12 + len(c[1])) + c[1]
+        elif c[0] == "fill":
+            n = c[2]
+            chunks += struct.pack("<HHIII", 0xcac2, 0, n, 16, c[1])
+        else:
+            n = c[1]
+            chunks += struct.pack("<HHII", 0xcac3, 0, n, 12)
+        total += n
+    return struct.pack("<IHHHHIIII", 0xed26ff3a, 1, 0, 28, 12, 4096, total,
+                       len(blocks), 0) + chunks
+
+
+def manifest(s, tmp):
+    """a whole layout in one session, payloads in the order ufb asks"""
+    raw = os.urandom(700000)
+    a, b = os.urandom(8192), os.urandom(4096)
+    sparse = sparse_image([("raw", a), ("fill", 0x5a5a5a5a, 3), ("skip", 2), ("raw", b)])
+    unpacked = os.urandom(300000)
+    packed = gzip.compress(unpacked)
+    outs = [os.path.join(tmp, n) for n in ("m-raw.bin", "m-sparse.bin", "m-gz.bin")]
+    payloads = [raw, sparse, packed]
+    text = "%s 1000 %x raw %s\n" % (outs[0], len(raw), hashlib.sha256(raw).hexdigest())
+    text += "%s 0 %x sparse\n" % (outs[1], len(sparse))
+    text += "%s 200 %x gzip\n" % (outs[2], len(packed))
+
+    s.send("Manifest:%08X" % len(text))
+    key, _, _ = s.status()
+    s.send(text)
+    key, n, info = s.status()
+    order = [int(i.split()[1]) for i in info if i.startswith("send ")]
+    ok = key == "OKAY" and n == "3" and sorted(order) == [0, 1, 2]
+    # one stream, chunk boundaries unrelated to the partitions
+    stream = b"".join(payloads[i] for i in order)
+    for i in range(0, len(stream), 100000):
+        ok = ok and s.download(stream[i:i + 100000]) == "OKAY"
+    key, _, info = s.cmd("Done")
+    ok = ok and key == "OKAY" and len(info) == 4 and all(" ok" in i for i in info[:3])
+    want = [bytes(0x1000) + raw,
+            a + b"\x5a" * 3 * 4096 + bytes(2 * 4096) + b,
+            bytes(0x200) + unpacked]
+    got = [open(o, "rb").read() for o in outs]
+    # the skipped blocks are holes that read back as zeros
+    check("manifest", ok and got == want)
+
+    # the device with the most left goes first, then the other one gets a turn
+    a, b, c = os.urandom(3000), os.urandom(3000), os.urandom(1000)
+    outa, outb = os.path.join(tmp, "m-a.bin"), os.path.join(tmp, "m-b.bin")
+    text = "%s 0 %x raw\n%s 0 %x raw\n/dev/null 0 %x raw\n" % (
+        outa, len(a), outb, len(b), len(c))
+    s.send("Manifest:%08X" % len(text))
+    s.status()
+    s.send(text)
+    key, _, info = s.status()
+    order = [int(i.split()[1]) for i in info if i.startswith("send ")]
+    ok = key == "OKAY" and order == [0, 2, 1]
+    ok = ok and s.download(a + c + b) == "OKAY" and s.cmd("Done")[0] == "OKAY"
+    check("manifest devices", ok and open(outa, "rb").read() == a and
+          open(outb, "rb").read() == b)
+
+    text = "%s 0 %x raw %s\n" % (outs[0], len(raw), "0" * 64)
+    s.send("Manifest:%08X" % len(text))
+    s.status()
+    s.send(text)
+    ok = s.status()[0] == "OKAY" and s.download(raw) == "OKAY"
+    key, _, info = s.cmd("Done")
+    check("manifest digest", ok and key == "FAIL" and "digest" in info[0])
+
+
+def resume(tmp):
+    """a transfer cut short by a reset continues from what was verified"""
+    jdir = os.path.join(tmp, "journal")
+    os.mkdir(jdir)
+    out = os.path.join(tmp, "resume.bin")
+    data = os.urandom(6 * 256 * 1024)
+    chunks = [data[i:i + 256 * 1024] for i in range(0, len(data), 256 * 1024)]
+
+    ufb, s = start(["-J", jdir], PORT + 1)
+    try:
+        ok = s.cmd("WOpen:" + out)[0] == "OKAY"
+        ok = ok and s.download(chunks[0], crc=zlib.crc32(chunks[0])) == "OKAY"
+        bad = s.download(chunks[1], crc=zlib.crc32(chunks[1]) ^ 1) == "FAIL" and \
+            s.reply == "CRC"
+        ok = ok and s.download(chunks[1], crc=zlib.crc32(chunks[1])) == "OKAY"
+        for c in chunks[2:4]:
+            ok = ok and s.download(c) == "OKAY"
+        check("bad CRC sent again", ok and bad)
+    finally:
+        ufb.kill()
+        ufb.wait()
+        s.close()
+
+    # the last chunk didn't make it to the target intact
+    with open(out, "r+b") as f:
+        f.seek(3 * 256 * 1024 + 5)
+        f.write(b"\xff")
+
+    ufb, s = start(["-J", jdir], PORT + 1)
+    try:
+        key, end, _ = s.cmd("Resume:" + out)
+        check("resume offset", key == "OKAY" and int(end, 16) == 3 * 256 * 1024)
+        ok = s.cmd("WOpen:" + out)[0] == "OKAY"
+        ok = ok and s.cmd("Seek:%X" % int(end, 16))[0] == "OKAY"
+        for c in chunks[3:]:
+            ok = ok and s.download(c) == "OKAY"
+        ok = ok and s.cmd("Close")[0] == "OKAY"
+        check("resumed transfer", ok and open(out, "rb").read() == data and
+              not os.listdir(jdir))
+        key, end, _ = s.cmd("Resume:" + out)
+        check("nothing to resume", key == "OKAY" and end == "0")
+    finally:
+        ufb.kill()
+        ufb.wait()
+        s.close()
+
+
+def resume_hint(tmp):
+    """a size hint at the resumed WOpen keeps what was verified, -D or not"""
+    jdir = os.path.join(tmp, "journal-hint")
+    os.mkdir(jdir)
+    img = os.path.join(tmp, "hint.img")
+    open(img, "wb").write(bytes(2 << 20))
+    # pre-discard only touches block devices, a loop device when we may
+    try:
+        out = subprocess.check_output(["losetup", "--find", "--show", img],
+                                      stderr=subprocess.DEVNULL).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        out = img
+    data = os.urandom(6 * 256 * 1024)
+    hint = "WOpen:%s,size=%X" % (out, len(data))
+
+    try:
+        ufb, s = start(["-D", "-J", jdir], PORT + 3)
+        try:
+            ok = s.cmd(hint)[0] == "OKAY"
+            for i in range(0, 3 * 256 * 1024, 256 * 1024):
+                ok = ok and s.download(data[i:i + 256 * 1024]) == "OKAY"
+        finally:
+            ufb.kill()
+            ufb.wait()
+            s.close()
+
+        ufb, s = start(["-D", "-J", jdir], PORT + 3)
+        try:
+            key, end, _ = s.cmd("Resume:" + out)
+            ok = ok and key == "OKAY" and int(end, 16) == 3 * 256 * 1024
+            ok = ok and s.cmd(hint)[0] == "OKAY"
+            ok = ok and s.cmd("Seek:%s" % end)[0] == "OKAY"
+            for i in range(3 * 256 * 1024, len(data), 256 * 1024):
+                ok = ok and s.download(data[i:i + 256 * 1024]) == "OKAY"
+            ok = ok and s.cmd("Close")[0] == "OKAY"
+            with open(out, "rb") as f:
+                got = f.read(len(data))
+            check("resume with size hint", ok and got == data)
+        finally:
+            ufb.kill()
+            ufb.wait()
+            s.close()
+    finally:
+        if out != img:
+            subprocess.call(["losetup", "-d", out])
+
+
+def usb_pipeline(tmp):
+    """journaled downloads handed over to the pipeline and to a handle writer"""
+    ep = os.path.join(tmp, "usb")
+    jdir = os.path.join(ep, "journal")
+    os.makedirs(jdir)
+    open(os.path.join(ep, "ep0"), "w").close()
+    os.mkfifo(os.path.join(ep, "ep1"))
+    os.mkfifo(os.path.join(ep, "ep2"))
+    outs = [os.path.join(tmp, "usb-%d.bin" % i) for i in range(2)]
+    data = os.urandom(32 * 4096)
+
+    ufb = subprocess.Popen([UFB, "-P", "-J", jdir, os.path.join(ep, "ep0")],
+                           stdout=subprocess.DEVNULL)
+    s = FifoSession(os.path.join(ep, "ep0"))
+    try:
+        ok = True
+        for out, handle in zip(outs, (False, True)):
+            key, h, _ = s.cmd("WOpen:" + out)
+            ok = ok and key == "OKAY"
+            for i in range(0, len(data), 4096):
+                ok = ok and s.download(data[i:i + 4096],
+                                       handle=h if handle else None) == "OKAY"
+            ok = ok and s.cmd("Close")[0] == "OKAY"
+        check("journaled pipeline and handle", ok and ufb.poll() is None and
+              all(open(out, "rb").read() == data for out in outs))
+    except EOFError:
+        check("journaled pipeline and handle", False)
+    finally:
+        ufb.kill()
+        ufb.wait()
+        s.close()
+
+
+def bound(tmp):
+    """an explicit address keeps the port off the others"""
+    ufb, s = start([], PORT + 2, "127.0.0.1:")
+    try:
+        ok = s.cmd("UCmd:true")[0] == "OKAY"
+        try:
+            Session(PORT + 2, "127.0.0.2").close()
+            other = False
+        except ConnectionRefusedError:
+            other = True
+        check("bound address", ok and other)
+    finally:
+        ufb.kill()
+        ufb.wait()
+        s.close()
+
+
+def main():
+    tmp = tempfile.mkdtemp()
+    try:
+        ufb, s = start([])
+    except RuntimeError:
+        check("ufb listening", False)
+        return
+    try:
+
+        key, _, info = s.cmd("UCmd:echo hello")
+        check("UCmd", key == "OKAY" and "hello" in "".join(info))
+        check("UCmd failure", s.cmd("UCmd:false")[0] == "FAIL")
+
+        data = os.urandom(3 * 1024 * 1024 + 17)
+        out = os.path.join(tmp, "seq.bin")
+        ok = s.cmd("WOpen:" + out)[0] == "OKAY"
+        for i in range(0, len(data), 1 << 20):
+            ok = ok and s.download(data[i:i + (1 << 20)]) == "OKAY"
+        ok = ok and s.cmd("Close")[0] == "OKAY"
+        check("sequential download", ok and open(out, "rb").read() == data)
+
+        # a size hint allocates the file and cuts what was there before
+        part = data[:1000000]
+        key, _, info = s.cmd("WOpen:%s,size=%X" % (out, len(part)))
+        ok = key == "OKAY" and "type=file" in info
+        ok = ok and s.download(part) == "OKAY" and s.cmd("Close")[0] == "OKAY"
+        check("sized WOpen", ok and open(out, "rb").read() == part)
+        check("bad size hint", s.cmd("WOpen:%s,size=12z" % out)[0] == "FAIL" and
+              not os.path.exists(out + ",size=12z"))
+        ok = s.cmd("WOpen:%s,size=%X" % (out, len(data)))[0] == "OKAY"
+        for i in range(0, len(data), 1 << 20):
+            ok = ok and s.download(data[i:i + (1 << 20)]) == "OKAY"
+        ok = ok and s.cmd("Close")[0] == "OKAY"
+
+        key, size, _ = s.cmd("ROpen:" + out)
+        got = b""
+        while key == "OKAY":
+            s.send("upload")
+            key, n, _ = s.status()
+            if key != "DATA":
+                break
+            chunk = s.recv()
+            key = s.status()[0]
+            if not chunk:
+                break
+            got += chunk
+        s.cmd("Close")
+        check("upload", got == data and int(size.split(",")[0], 16) == len(data))
+
+        # several connections writing their own stripes of one file
+        data = os.urandom(16 * 1024 * 1024)
+        out = os.path.join(tmp, "par.bin")
+        conns = [Session() for _ in range(4)]
+        results = []
+        check("parallel open", s.cmd("WOpen:" + out)[0] == "OKAY")
+
+        def stripe(c, idx):
+            chunk = 1 << 20
+            for off in range(idx * chunk, len(data), chunk * len(conns)):
+                results.append(c.download(data[off:off + chunk], off))
+
+        t0 = time.time()
+        threads = [threading.Thread(target=stripe, args=(c, i))
+                   for i, c in enumerate(conns)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        elapsed = time.time() - t0
+        check("parallel close", s.cmd("Close")[0] == "OKAY")
+        check("parallel download (%.0f MB/s)" % (len(data) / 1e6 / elapsed),
+              results == ["OKAY"] * 16 and open(out, "rb").read() == data)
+        for c in conns:
+            c.close()
+
+        # two targets open at once, chunks interleaved
+        a, b = os.urandom(3000000), os.urandom(2000000)
+        outa, outb = os.path.join(tmp, "a.bin"), os.path.join(tmp, "b.bin")
+        key, ha, _ = s.cmd("WOpen:" + outa)
+        key2, hb, _ = s.cmd("WOpen:" + outb)
+        ok = key == key2 == "OKAY" and ha != hb
+        for i in range(0, 3000000, 500000):
+            ok = ok and s.download(a[i:i + 500000], handle=ha) == "OKAY"
+            if i < 2000000:
+                ok = ok and s.download(b[i:i + 500000], handle=hb) == "OKAY"
+        ok = ok and s.cmd("Close#" + ha)[0] == "OKAY"
+        ok = ok and s.cmd("Close#" + hb)[0] == "OKAY"
+        check("handles", ok and open(outa, "rb").read() == a and
+              open(outb, "rb").read() == b)
+        check("closed handle", s.cmd("Close#" + ha)[0] == "FAIL")
+
+        key, size, _ = s.cmd("ROpen:" + outa)
+        check("ROpen handle", key == "OKAY" and int(size.split(",")[0], 16) == 3000000
+              and len(size.split(",")) == 2)
+        s.cmd("Close")
+
+        # pipe target, goes through splice to the child's stdin
+        out = os.path.join(tmp, "pipe.bin")
+        data = os.urandom(300000)
+        ok = s.cmd("ACmd:cat > " + out)[0] == "OKAY"
+        key, _, info = s.cmd("WOpen:-,size=%X" % len(data))
+        ok = ok and key == "OKAY" and "type=pipe" in info
+        ok = ok and s.download(data) == "OKAY"
+        ok = ok and s.cmd("Close")[0] == "OKAY"
+        ok = ok and s.cmd("Sync")[0] == "OKAY"
+        check("download to a pipe", ok and open(out, "rb").read() == data)
+
+        # a target that can't take the data keeps the stream in sync
+        ok = s.cmd("WOpen:" + tmp)[0] == "FAIL"
+        ok = ok and s.download(b"x" * 100000) == "FAIL"
+        check("failed download", ok and s.cmd("UCmd:true")[0] == "OKAY")
+
+        # erase a range of a file, it is punched or written with zeros
+        out = os.path.join(tmp, "erase.bin")
+        data = os.urandom(1 << 20)
+        open(out, "wb").write(data)
+        key, _, info = s.cmd("Erase:%s,%X,%X,zero" % (out, 0x10000, 0x20000))
+        got = open(out, "rb").read()
+        check("erase range", key == "OKAY" and got[:0x10000] == data[:0x10000] and
+              got[0x10000:0x30000] == bytes(0x20000) and got[0x30000:] == data[0x30000:])
+        check("erase missing", s.cmd("Erase:" + out + ".none")[0] == "FAIL")
+
+        s.send("Loopback:%X" % 65536)
+        key, n, _ = s.status()
+        payload = os.urandom(65536)
+        s.send(payload)
+        echo = s.recv()
+        key, _, info = s.status()
+        check("loopback", key == "OKAY" and echo == payload)
+
+        key, _, info = s.cmd("Caps")
+        check("caps", key == "OKAY" and "tcp" in info[0])
+
+        manifest(s, tmp)
+        s.close()
+
+        resume(tmp)
+        resume_hint(tmp)
+        usb_pipeline(tmp)
+        bound(tmp)
+    finally:
+        ufb.kill()
+        ufb.wait()
+        subprocess.call(["rm", "-rf", tmp])
+
+    print("%d passed, %d failed" % (passed, failed))
+
+
+main()
+sys.exit(1 if failed else 0)
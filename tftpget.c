@@ -0,0 +1,372 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * TFTP client fetching a file straight to its destination
+ *
+ *	tftpget [-b blksize] [-w windowsize] [-p port] <server> <remote> <local>
+ *
+ * Asks for a large block size and the RFC 7440 window, so the server
+ * sends a whole window of blocks per acknowledgement instead of one. The
+ * data is written to <local>.part as it arrives, synced and renamed at
+ * the end, so <local> only ever exists complete. Servers without option
+ * support fall back to plain 512 byte lock-step transfers.
+ *
+ * Copyright (C) 2024 NXP
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define OP_RRQ		1
+#define OP_DATA		3
+#define OP_ACK		4
+#define OP_ERROR	5
+#define OP_OACK		6
+
+#define DEFAULT_BLKSIZE	8192
+#define DEFAULT_WINDOW	16
+#define MAX_BLKSIZE	65464
+
+/* ms to wait for data before acknowledging again, and how often */
+#define TIMEOUT_MS	1000
+#define RETRIES		5
+
+struct tftp {
+	int sock;
+	struct sockaddr_storage peer;	/* server TID once it answered */
+	socklen_t peer_len;
+	int have_tid;
+	unsigned int blksize;
+	unsigned int window;
+	unsigned long long tsize;
+};
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int send_ack(struct tftp *t, uint16_t block)
+{
+	uint8_t pkt[4] = { 0, OP_ACK, block >> 8, block & 0xff };
+
+	return sendto(t->sock, pkt, sizeof(pkt), 0,
+		      (struct sockaddr *)&t->peer, t->peer_len) < 0 ? -1 : 0;
+}
+
+static int send_rrq(struct tftp *t, const struct sockaddr *addr, socklen_t len,
+		    const char *remote, int options)
+{
+	char pkt[512];
+	int n;
+
+	pkt[0] = 0;
+	pkt[1] = OP_RRQ;
+	n = 2 + snprintf(pkt + 2, sizeof(pkt) - 2, "%s", remote) + 1;
+	n += snprintf(pkt + n, sizeof(pkt) - n, "octet") + 1;
+	if (options) {
+		n += snprintf(pkt + n, sizeof(pkt) - n, "blksize") + 1;
+		n += snprintf(pkt + n, sizeof(pkt) - n, "%u", t->blksize) + 1;
+		n += snprintf(pkt + n, sizeof(pkt) - n, "windowsize") + 1;
+		n += snprintf(pkt + n, sizeof(pkt) - n, "%u", t->window) + 1;
+		n += snprintf(pkt + n, sizeof(pkt) - n, "tsize") + 1;
+		n += snprintf(pkt + n, sizeof(pkt) - n, "0") + 1;
+	}
+	if (n > sizeof(pkt))
+		return -1;
+
+	return sendto(t->sock, pkt, n, 0, addr, len) < 0 ? -1 : 0;
+}
+
+/* take what the server accepted; options it left out get the defaults */
+static int parse_oack(struct tftp *t, const char *p, const char *end)
+{
+	const char *name, *value;
+	unsigned long v;
+
+	t->blksize = 512;
+	t->window = 1;
+
+	while (p < end) {
+		name = p;
+		value = memchr(p, 0, end - p);
+		if (!value++ || value >= end || !memchr(value, 0, end - value))
+			return -1;
+		p = value + strlen(value) + 1;
+
+		v = strtoul(value, NULL, 10);
+		if (strcasecmp(name, "blksize") == 0) {
+			if (v < 8 || v > MAX_BLKSIZE)
+				return -1;
+			t->blksize = v;
+		} else if (strcasecmp(name, "windowsize") == 0) {
+			if (v < 1)
+				return -1;
+			t->window = v;
+		} else if (strcasecmp(name, "tsize") == 0) {
+			t->tsize = strtoull(value, NULL, 10);
+		}
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *p, size_t size)
+{
+	ssize_t r;
+
+	while (size) {
+		r = write(fd, p, size);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p = (const uint8_t *)p + r;
+		size -= r;
+	}
+	return 0;
+}
+
+/*
+ * Receive the file. Blocks are written in order; anything out of order
+ * makes us acknowledge the last good block once, which restarts the
+ * server's window from there. Silence makes us repeat that ack.
+ */
+static int receive(struct tftp *t, int fd, const uint8_t *first, ssize_t first_len,
+		   unsigned long long *total)
+{
+	uint8_t *pkt;
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	struct pollfd pfd = { .fd = t->sock, .events = POLLIN };
+	uint16_t expect = 1, block;
+	unsigned int in_window = 0, retries = 0;
+	int nacked = 0, ret = -1;
+	ssize_t n;
+
+	pkt = malloc(t->blksize + 4);
+	if (!pkt)
+		return -1;
+
+	*total = 0;
+	while (1) {
+		if (first) {
+			memcpy(pkt, first, first_len);
+			n = first_len;
+			first = NULL;
+		} else {
+			if (poll(&pfd, 1, TIMEOUT_MS) <= 0) {
+				if (++retries > RETRIES) {
+					printf("tftpget: timeout\n");
+					break;
+				}
+				send_ack(t, expect - 1);
+				in_window = 0;
+				continue;
+			}
+			from_len = sizeof(from);
+			n = recvfrom(t->sock, pkt, t->blksize + 4, 0,
+				     (struct sockaddr *)&from, &from_len);
+			if (n < 4)
+				continue;
+			/* RFC 1350: packets from anybody else are not ours */
+			if (from_len != t->peer_len || memcmp(&from, &t->peer, from_len))
+				continue;
+		}
+
+		if (pkt[1] == OP_ERROR) {
+			printf("tftpget: server error %u: %.*s\n", pkt[2] << 8 | pkt[3],
+			       (int)(n - 4), (char *)pkt + 4);
+			break;
+		}
+		if (pkt[1] != OP_DATA)
+			continue;
+
+		block = pkt[2] << 8 | pkt[3];
+		if (block != expect) {
+			/* only once per gap, the server restarts from our ack */
+			if (!nacked) {
+				send_ack(t, expect - 1);
+				nacked = 1;
+				in_window = 0;
+			}
+			continue;
+		}
+		retries = 0;
+		nacked = 0;
+
+		if (write_full(fd, pkt + 4, n - 4)) {
+			printf("tftpget: write failed: %s\n", strerror(errno));
+			break;
+		}
+		*total += n - 4;
+		expect++;
+
+		/* a short block ends the transfer */
+		if (n - 4 < t->blksize) {
+			send_ack(t, block);
+			ret = 0;
+			break;
+		}
+		if (++in_window == t->window) {
+			send_ack(t, block);
+			in_window = 0;
+		}
+	}
+
+	free(pkt);
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [-b blksize] [-w windowsize] [-p port] <server> <remote> <local>\n",
+	       name);
+}
+
+int main(int argc, char **argv)
+{
+	struct addrinfo hints = { .ai_socktype = SOCK_DGRAM }, *ai;
+	struct tftp t = { .blksize = DEFAULT_BLKSIZE, .window = DEFAULT_WINDOW };
+	struct pollfd pfd;
+	const char *port = "69", *local;
+	char part[4096];
+	uint8_t pkt[MAX_BLKSIZE + 4];
+	unsigned long long total = 0;
+	uint64_t start;
+	ssize_t n = 0;
+	int opt, fd, err, options, tries, ret = 1;
+
+	while ((opt = getopt(argc, argv, "b:w:p:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			t.blksize = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			t.window = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (argc - optind != 3 || t.blksize < 8 || t.blksize > MAX_BLKSIZE || !t.window) {
+		usage(argv[0]);
+		return 1;
+	}
+	local = argv[optind + 2];
+
+	err = getaddrinfo(argv[optind], port, &hints, &ai);
+	if (err) {
+		printf("tftpget: %s: %s\n", argv[optind], gai_strerror(err));
+		return 1;
+	}
+	t.sock = socket(ai->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (t.sock < 0) {
+		printf("tftpget: socket: %s\n", strerror(errno));
+		return 1;
+	}
+	pfd.fd = t.sock;
+	pfd.events = POLLIN;
+
+	/* a whole window must fit in the socket buffer or blocks get dropped */
+	opt = t.window * (t.blksize + 32);
+	setsockopt(t.sock, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
+
+	/* the first answer tells whether the server took the options */
+	start = now_ms();
+	for (options = 1; options >= 0 && !t.have_tid; options--) {
+		for (tries = 0; tries <= RETRIES; tries++) {
+			if (send_rrq(&t, ai->ai_addr, ai->ai_addrlen, argv[optind + 1], options)) {
+				printf("tftpget: send: %s\n", strerror(errno));
+				return 1;
+			}
+			if (poll(&pfd, 1, TIMEOUT_MS) <= 0)
+				continue;
+			t.peer_len = sizeof(t.peer);
+			n = recvfrom(t.sock, pkt, sizeof(pkt), 0,
+				     (struct sockaddr *)&t.peer, &t.peer_len);
+			if (n < 4)
+				continue;
+			/* "option not supported", ask again without */
+			if (pkt[1] == OP_ERROR && (pkt[2] << 8 | pkt[3]) == 8 && options)
+				break;
+			t.have_tid = 1;
+			break;
+		}
+	}
+	freeaddrinfo(ai);
+	if (!t.have_tid) {
+		printf("tftpget: no answer from %s\n", argv[optind]);
+		return 1;
+	}
+
+	snprintf(part, sizeof(part), "%s.part", local);
+	fd = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		printf("tftpget: can't create %s: %s\n", part, strerror(errno));
+		return 1;
+	}
+
+	if (pkt[1] == OP_OACK) {
+		if (parse_oack(&t, (char *)pkt + 2, (char *)pkt + n)) {
+			printf("tftpget: bad option acknowledgement\n");
+			goto out;
+		}
+		/* reserve the space up front where the filesystem can */
+		if (t.tsize)
+			fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, t.tsize);
+		send_ack(&t, 0);
+		n = 0;
+	} else {
+		/* plain RFC 1350 server, the answer is already block 1 */
+		t.blksize = 512;
+		t.window = 1;
+	}
+
+	printf("tftpget: %s blksize %u window %u size %llu\n", argv[optind + 1],
+	       t.blksize, t.window, t.tsize);
+
+	if (receive(&t, fd, n ? pkt : NULL, n, &total))
+		goto out;
+
+	if (t.tsize && total != t.tsize) {
+		printf("tftpget: got %llu bytes, expected %llu\n", total, t.tsize);
+		goto out;
+	}
+	if (fsync(fd)) {
+		printf("tftpget: fsync: %s\n", strerror(errno));
+		goto out;
+	}
+	if (rename(part, local)) {
+		printf("tftpget: can't rename to %s: %s\n", local, strerror(errno));
+		goto out;
+	}
+	ret = 0;
+
+	n = now_ms() - start;
+	printf("tftpget: %llu bytes in %zd ms, %llu kB/s\n", total, n,
+	       total * 1000 / 1024 / (n ? n : 1));
+out:
+	close(fd);
+	if (ret)
+		unlink(part);
+	return ret;
+}
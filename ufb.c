@@ -5,10 +5,12 @@
  * Copyright (C) 2024 NXP
  * Author: Frank Li <Frank.Li@nxp.com>
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -16,10 +18,27 @@
 #include <fcntl.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <linux/usb/functionfs.h>
+#include <linux/fs.h>
+#include <mtd/mtd-user.h>
+
+#include "storage.h"
 
 #define PACKAGE "uuu fastboot client"
 #define VERSION "1.0.0"
@@ -215,6 +234,84 @@ static const struct usb_fs_desc g_descriptors = {
 	.property_data = "{4866319A-F4D6-4374-93B9-DC2DEB361BA9}",
 };
 
+/*
+ * Extended descriptor set, "ufb -n <pairs> [-b <burst>]": the control
+ * pair ep1 (IN)/ep2 (OUT) stays as above, followed by up to
+ * MAX_DATA_PAIRS data pairs ep3/ep4, ep5/ep6, ... and SuperSpeed
+ * companions asking for 'burst' packets per burst. Without options the
+ * static legacy set is used.
+ */
+#define MAX_DATA_PAIRS 6
+
+static int g_pairs;
+static int g_burst = 1;
+
+static uint8_t *put_desc(uint8_t *p, const void *desc, size_t len)
+{
+	memcpy(p, desc, len);
+	return p + len;
+}
+
+static void *build_descriptors(int pairs, int burst, size_t *size)
+{
+	static const int mps[] = { 0, 512, 1024 };
+	struct usb_interface_descriptor intf = {
+		.bLength = USB_DT_INTERFACE_SIZE,
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bNumEndpoints = 2 + 2 * pairs,
+		.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+		.iInterface = 1,
+	};
+	struct usb_endpoint_descriptor_no_audio ep = {
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bmAttributes = USB_ENDPOINT_XFER_BULK,
+	};
+	struct usb_ss_ep_comp_descriptor comp = {
+		.bLength = USB_DT_SS_EP_COMP_SIZE,
+		.bDescriptorType = USB_DT_SS_ENDPOINT_COMP,
+		.bMaxBurst = burst - 1,
+	};
+	struct usb_functionfs_descs_head_v2 head = {
+		.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+		.flags = g_descriptors.header.flags,
+	};
+	size_t os_len = sizeof(g_descriptors) - offsetof(struct usb_fs_desc, os_header);
+	int eps = 2 + 2 * pairs, speed, i;
+	__le32 count[4];
+	uint8_t *buf, *p;
+
+	*size = sizeof(head) + sizeof(count) +
+		3 * USB_DT_INTERFACE_SIZE + 3 * eps * USB_DT_ENDPOINT_SIZE +
+		eps * USB_DT_SS_EP_COMP_SIZE + os_len;
+	buf = malloc(*size);
+	if (!buf)
+		return NULL;
+
+	head.length = cpu_to_le32(*size);
+	count[0] = count[1] = cpu_to_le32(1 + eps);
+	count[2] = cpu_to_le32(1 + 2 * eps);
+	count[3] = g_descriptors.os_count;
+
+	p = put_desc(buf, &head, sizeof(head));
+	p = put_desc(p, count, sizeof(count));
+	for (speed = 0; speed < 3; speed++) {
+		p = put_desc(p, &intf, USB_DT_INTERFACE_SIZE);
+		for (i = 0; i < eps; i++) {
+			/* IN first in every pair, like ep1/ep2 */
+			ep.bEndpointAddress = (i + 1) | (i & 1 ? USB_DIR_OUT : USB_DIR_IN);
+			ep.wMaxPacketSize = cpu_to_le16(mps[speed]);
+			ep.bInterval = speed && (i & 1) ? 1 : 0;
+			p = put_desc(p, &ep, USB_DT_ENDPOINT_SIZE);
+			if (speed == 2)
+				p = put_desc(p, &comp, USB_DT_SS_EP_COMP_SIZE);
+		}
+	}
+	put_desc(p, &g_descriptors.os_header, os_len);
+
+	return buf;
+}
+
 pid_t popen2(const char *command, int *infp, int *outfp)
 {
 	int p_stdin[2], p_stdout[2];
@@ -269,30 +366,1850 @@ union FBFrame{
 	};
 };
 
-#define INFO (('I') | ('N' << 8) | ('F' << 16) | ('O' << 24))
-#define FAIL (('F') | ('A' << 8) | ('I' << 16) | ('L' << 24))
-#define OKAY (('O') | ('K' << 8) | ('A' << 16) | ('Y' << 24))
-#define DATA (('D') | ('A' << 8) | ('T' << 16) | ('A' << 24))
+#define INFO (('I') | ('N' << 8) | ('F' << 16) | ('O' << 24))
+#define FAIL (('F') | ('A' << 8) | ('I' << 16) | ('L' << 24))
+#define OKAY (('O') | ('K' << 8) | ('A' << 16) | ('Y' << 24))
+#define DATA (('D') | ('A' << 8) | ('T' << 16) | ('A' << 24))
+
+int g_stdin  = -1;
+int g_stdout = -1;
+int g_pid = -1;
+/* per thread, every TCP connection is served by its own */
+__thread int g_ep_sink = -1;
+__thread int g_ep_source = -1;
+int g_ep_0 = -1;
+int g_open_file = -1;
+
+/* data pair endpoints, and how many of them Stripe: enabled */
+int g_data_in[MAX_DATA_PAIRS];
+int g_data_out[MAX_DATA_PAIRS];
+int g_stripe;
+
+/* transfer size recommended to the host and the last measured sink rate */
+struct xfer_tuner g_tuner;
+uint32_t g_sink_rate;
+
+/* largest download buffer ever recommended */
+#define MAX_XFER_SIZE (64 << 20)
+
+/* optional protocol features, reported by Caps */
+static const char *g_features[] = {
+	"selftest", "loopback", "caps", "tcp", "offset", "stripe", "cache",
+	"handles", "erase", "resume", "manifest", NULL,
+};
+
+/*
+ * TCP transport, "ufb tcp:[<addr>:]<port>": the same frames as over USB,
+ * each message preceded by its length as 32 bit little endian. Commands
+ * take the lock exclusively, except positioned downloads which can run on
+ * several connections at once.
+ *
+ * There is no authentication, anyone reaching the port can run commands
+ * as root. Bind it to the USB link: the NCM address, a link local address
+ * with its scope (fe80::1%usb0) or "%usb0" for the whole interface, and
+ * never expose the port beyond that link.
+ */
+static int g_tcp;
+static pthread_rwlock_t g_cmd_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* pipe size and largest single splice of a TCP download */
+#define SPLICE_CHUNK (1 << 20)
+
+size_t round_up_to_cache_line(size_t size)
+{
+	return (size + 0x7f) & ~0x7f;
+}
+
+static int read_full(int fd, void *p, size_t size)
+{
+	ssize_t r;
+
+	while (size) {
+		r = read(fd, p, size);
+		if (r <= 0) {
+			if (r == 0)
+				errno = EPIPE;
+			else if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p = (uint8_t *)p + r;
+		size -= r;
+	}
+	return 0;
+}
+
+/* write everything, at *off if given, waiting when fd is non-blocking */
+static int write_at(int fd, const void *p, size_t size, off_t *off)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	ssize_t r;
+
+	while (size) {
+		r = off ? pwrite(fd, p, size, *off) : write(fd, p, size);
+		if (r < 0) {
+			if (errno == EAGAIN) {
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p = (const uint8_t *)p + r;
+		size -= r;
+		if (off)
+			*off += r;
+	}
+	return 0;
+}
+
+/*
+ * zero elision and erase unit coalescing for the target opened last,
+ * handles have their own
+ */
+static struct blk_sink g_blk = { .fd = -1 };
+
+/* discard block targets at WOpen, they are about to be rewritten */
+static int g_prediscard;
+
+/*
+ * BLKDISCARD only, of the bytes from..to the image is going to cover: a
+ * device that can't discard is left alone, zeroing it instead would
+ * take longer than writing the image
+ */
+static void prediscard(int fd, uint64_t from, uint64_t to)
+{
+	uint64_t range[2], start = now_us();
+	int block = 512;
+
+	ioctl(fd, BLKSSZGET, &block);
+	range[0] = (from + block - 1) & ~(uint64_t)(block - 1);
+	to &= ~(uint64_t)(block - 1);
+	if (to <= range[0])
+		return;
+	range[1] = to - range[0];
+	if (ioctl(fd, BLKDISCARD, range)) {
+		if (errno == EOPNOTSUPP || errno == ENOTTY)
+			printf("pre-discard skipped, no discard support\n");
+		else
+			printf("pre-discard failed: %s\n", strerror(errno));
+		return;
+	}
+	printf("pre-discarded 0x%llx bytes in %llu ms\n", (unsigned long long)range[1],
+	       (unsigned long long)(now_us() - start) / 1000);
+}
+
+/* writeback policy of the targets, see blk_sink_policy() */
+static uint64_t g_wb_every;
+static int g_direct;
+static uint64_t g_durable;	/* last reported */
+
+/*
+ * io_uring where the kernel has it, unless -S: writes of the target are
+ * queued several at a time and fsynced by Close, uploads read the next
+ * chunk while the current one is sent. Only commands holding g_cmd_lock
+ * exclusively use it.
+ */
+static struct uring *g_ring;
+static int g_sync_io;
+
+static struct {
+	int fd;
+	off_t pos;		/* of the read in flight */
+	int len;
+	int idx;		/* its ring buffer, -1 if none */
+} g_ahead = { -1, 0, 0, -1 };
+
+/* before fd is closed, or another file could get its number */
+static void ring_forget(int fd)
+{
+	if (!g_ring)
+		return;
+	if (g_ahead.idx >= 0 && g_ahead.fd == fd) {
+		uring_release(g_ring, g_ahead.idx);
+		g_ahead.idx = -1;
+	}
+	uring_forget(g_ring, fd);
+}
+
+/*
+ * read() for upload, from the read started ahead by the last upload if
+ * it is the one wanted. *data is where the data is, *idx its ring buffer
+ * to release, -1 if it is p.
+ */
+static int upload_read(int fd, void *p, int max, void **data, int *idx)
+{
+	off_t pos = g_ring && max <= URING_BUF_SIZE ? lseek(fd, 0, SEEK_CUR) : -1;
+	int ret, i;
+
+	*data = p;
+	*idx = -1;
+	if (pos < 0)
+		return read(fd, p, max);
+
+	if (g_ahead.idx >= 0 && g_ahead.fd == fd && g_ahead.pos == pos && g_ahead.len == max) {
+		i = g_ahead.idx;
+	} else {
+		if (g_ahead.idx >= 0)
+			uring_release(g_ring, g_ahead.idx);
+		i = uring_read(g_ring, fd, max, pos);
+	}
+	g_ahead.idx = -1;
+	if (i < 0)
+		return read(fd, p, max);
+
+	ret = uring_read_wait(g_ring, i, data);
+	if (ret < 0) {
+		uring_release(g_ring, i);
+		errno = -ret;
+		return -1;
+	}
+	*idx = i;
+	lseek(fd, pos + ret, SEEK_SET);
+
+	/* not at the end yet, start on the next chunk */
+	if (ret == max) {
+		g_ahead.fd = fd;
+		g_ahead.pos = pos + ret;
+		g_ahead.len = max;
+		g_ahead.idx = uring_read(g_ring, fd, max, pos + ret);
+	}
+	return ret;
+}
+
+/* write_at, through the sink for block devices or a writeback policy */
+static int sink_write(struct blk_sink *z, int fd, const void *p, size_t size, off_t *off)
+{
+	if (z->managed && z->fd == fd)
+		return blk_sink_write(z, p, size, off);
+	return write_at(fd, p, size, off);
+}
+
+void send_data(void *p, size_t size)
+{
+	uint32_t len = cpu_to_le32(size);
+	int r;
+
+	if (g_tcp) {
+		send(g_ep_sink, &len, sizeof(len), MSG_MORE);
+		r = write_at(g_ep_sink, p, size, NULL);
+	} else {
+		r = write(g_ep_sink, p, size);
+	}
+	if (r < 0)
+		printf("failure write to usb ep\n");
+}
+
+/* one USB transfer, or one length prefixed TCP message */
+static ssize_t recv_msg(void *p, size_t max)
+{
+	uint32_t len;
+
+	if (!g_tcp)
+		return read(g_ep_source, p, max);
+
+	if (read_full(g_ep_source, &len, sizeof(len)))
+		return -1;
+	len = le32_to_cpu(len);
+	if (len > max) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (read_full(g_ep_source, p, len))
+		return -1;
+	return len;
+}
+
+/* take n bytes out of a pipe without keeping them */
+static void drain_pipe(int fd, ssize_t n)
+{
+	char junk[4096];
+	ssize_t r;
+
+	while (n > 0) {
+		r = read(fd, junk, n < sizeof(junk) ? n : sizeof(junk));
+		if (r <= 0)
+			break;
+		n -= r;
+	}
+}
+
+/*
+ * TCP download: move 'size' bytes from the socket to 'fd' through a
+ * pipe, never touching user space unless fd can't take a splice. Data
+ * the file refuses is still read, so the stream stays in sync. Zero
+ * runs aren't looked for, the data never gets here to be scanned.
+ * Returns 0 or the negative error, -ECONNRESET if the connection is gone.
+ */
+static int splice_download(int sock, int fd, size_t size, off_t *off)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	char *buf = NULL;
+	ssize_t n, m;
+	int p[2], err = 0;
+
+	if (pipe2(p, O_CLOEXEC))
+		return -errno;
+	fcntl(p[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+
+	while (size) {
+		n = size < SPLICE_CHUNK ? size : SPLICE_CHUNK;
+		n = splice(sock, NULL, p[1], NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n <= 0) {
+			err = -ECONNRESET;
+			break;
+		}
+		size -= n;
+
+		while (n > 0 && !err) {
+			if (buf) {
+				m = read(p[0], buf, n);
+				if (m <= 0)
+					err = -EIO;
+				else
+					err = write_at(fd, buf, m, off);
+			} else {
+				m = splice(p[0], NULL, fd, off, n, SPLICE_F_MOVE);
+				if (m < 0 && errno == EINVAL) {
+					/* no splice_write, bounce through memory */
+					buf = malloc(SPLICE_CHUNK);
+					if (!buf)
+						err = -ENOMEM;
+					continue;
+				}
+				if (m < 0 && errno == EAGAIN) {
+					poll(&pfd, 1, -1);
+					continue;
+				}
+				if (m <= 0)
+					err = m ? -errno : -EIO;
+			}
+			if (!err)
+				n -= m;
+		}
+		drain_pipe(p[0], n);
+	}
+
+	free(buf);
+	close(p[0]);
+	close(p[1]);
+	return err;
+}
+
+void send_info(const char *fmt, ...)
+{
+	union FBFrame fm;
+	va_list ap;
+
+	memset(&fm, 0, sizeof(fm));
+	fm.key = INFO;
+	va_start(ap, fmt);
+	vsnprintf(fm.data, MAX_FRAME_DATA_SIZE, fmt, ap);
+	va_end(ap);
+	send_data(&fm, 4 + strlen(fm.data));
+}
+
+static void erase_progress(void *arg, uint64_t done, uint64_t total)
+{
+	send_info("erase 0x%llx/0x%llx", (unsigned long long)done,
+		  (unsigned long long)total);
+}
+
+/*
+ * WOpen:<target>[,size=<hex size>]: knowing what the target is and how much
+ * is coming, each kind is prepared its own way. Files get their blocks
+ * allocated at once and are cut to the size, block devices have to be
+ * large enough and large images bypass the page cache, MTD is erased
+ * as far as the image goes since it is only programmed erased, and the
+ * pipe to a child takes more per wakeup. INFO "type=..." tells which.
+ * The first keep bytes, verified by Resume:, are not erased.
+ */
+#define WOPEN_DIRECT_MIN	(64 << 20)
+#define WOPEN_PIPE_SIZE		(1 << 20)
+
+static int wopen_prepare(int fd, uint64_t size, uint64_t keep, int *direct)
+{
+	struct mtd_info_user info;
+	const char *method;
+	struct stat st;
+	uint64_t dev;
+
+	*direct = g_direct;
+	if (fstat(fd, &st))
+		return -errno;
+
+	if (S_ISFIFO(st.st_mode)) {
+		send_info("type=pipe");
+		if (fcntl(fd, F_SETPIPE_SZ, WOPEN_PIPE_SIZE) < 0)
+			printf("pipe size left at %d\n", fcntl(fd, F_GETPIPE_SZ));
+		return 0;
+	}
+	if (S_ISREG(st.st_mode)) {
+		send_info("type=file");
+		if (!size)
+			return 0;
+		if (fallocate(fd, 0, 0, size) && errno != EOPNOTSUPP)
+			return -errno;
+		/* the old contents past the image don't belong to it */
+		if (st.st_size > size && ftruncate(fd, size))
+			return -errno;
+		return 0;
+	}
+	if (S_ISBLK(st.st_mode)) {
+		send_info("type=blk");
+		if (ioctl(fd, BLKGETSIZE64, &dev))
+			return -errno;
+		if (size > dev)
+			return -ENOSPC;
+		if (size >= WOPEN_DIRECT_MIN)
+			*direct = 1;
+		return 0;
+	}
+	if (S_ISCHR(st.st_mode) && ioctl(fd, MEMGETINFO, &info) == 0) {
+		send_info("type=mtd");
+		if (!size)
+			return 0;
+		size = (size + info.erasesize - 1) / info.erasesize * info.erasesize;
+		if (size > info.size)
+			return -ENOSPC;
+		/* the block the resumed data ends in can't be erased either */
+		keep = (keep + info.erasesize - 1) / info.erasesize * info.erasesize;
+		if (keep >= size)
+			return 0;
+		return storage_erase(fd, keep, size - keep, ERASE_ZERO, erase_progress, NULL,
+				     &method);
+	}
+	send_info("type=other");
+	return 0;
+}
+
+/* wMaxPacketSize and burst of an endpoint at the current bus speed */
+void ep_caps(int ep, unsigned int *maxpacket, unsigned int *burst)
+{
+	struct usb_endpoint_descriptor desc;
+
+	*maxpacket = *burst = 0;
+	if (ioctl(ep, FUNCTIONFS_ENDPOINT_DESC, &desc) < 0)
+		return;
+	*maxpacket = le16_to_cpu(desc.wMaxPacketSize);
+	*burst = 1;
+	/* only SuperSpeed bursts, the companion descriptor is ours */
+	if (*maxpacket >= 1024)
+		*burst = g_burst;
+}
+
+/*
+ * Striped transfers over the g_stripe data pairs: the data is cut in
+ * g_stripe parts of size / g_stripe rounded up to 4 kB, pair i carries
+ * part i, pairs left without data aren't used.
+ */
+struct stripe {
+	int fd;
+	uint8_t *p;
+	size_t len;
+	ssize_t ret;
+	int in;
+	pthread_t thread;
+};
+
+static size_t stripe_part(size_t size)
+{
+	return ((size + g_stripe - 1) / g_stripe + 0xfff) & ~(size_t)0xfff;
+}
+
+static void *stripe_worker(void *arg)
+{
+	struct stripe *s = arg;
+
+	if (s->in)
+		s->ret = write(s->fd, s->p, s->len);
+	else
+		s->ret = read(s->fd, s->p, round_up_to_cache_line(s->len));
+	return NULL;
+}
+
+/* 'in' as seen by the host; p must hold round_up_to_cache_line(size) */
+static int stripe_xfer(uint8_t *p, size_t size, int in)
+{
+	struct stripe s[MAX_DATA_PAIRS];
+	size_t part = stripe_part(size);
+	int i, n, ret = 0;
+
+	for (n = 0; n < g_stripe && n * part < size; n++) {
+		s[n].fd = in ? g_data_in[n] : g_data_out[n];
+		s[n].p = p + n * part;
+		s[n].len = size - n * part < part ? size - n * part : part;
+		s[n].in = in;
+		s[n].ret = -1;
+	}
+
+	/* part 0 is moved by this thread */
+	for (i = 1; i < n; i++)
+		if (pthread_create(&s[i].thread, NULL, stripe_worker, &s[i]))
+			s[i].thread = pthread_self();
+	if (n)
+		stripe_worker(&s[0]);
+	for (i = 1; i < n; i++) {
+		if (pthread_equal(s[i].thread, pthread_self()))
+			stripe_worker(&s[i]);
+		else
+			pthread_join(s[i].thread, NULL);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (s[i].ret != s[i].len) {
+			printf("stripe %d: %zd of %zu bytes\n", i, s[i].ret, s[i].len);
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Download pipeline, "ufb -P": the command thread only receives, a hash
+ * thread keeps the CRC-32 of the data and a writer thread puts it on the
+ * storage, with bounded queues in between. donwload: is acknowledged as
+ * soon as its data is queued, so write errors are reported by Close.
+ * Every other command waits for the pipeline to drain first.
+ */
+#define PIPE_DEPTH	4
+#define PIPE_STAGES	3
+#define PIPE_MAX_POLICIES 8
+
+enum { STAGE_RX, STAGE_HASH, STAGE_WRITE };
+
+struct pipe_job {
+	uint8_t *p;
+	size_t len;
+	int fd;
+	off_t off;		/* < 0: at the current position */
+};
+
+struct pipe_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pipe_job job[PIPE_DEPTH];
+	int head, count;
+	uint64_t pushes, depth_sum;	/* occupancy seen by every push */
+	int depth_max;
+};
+
+struct pipe_stage {
+	const char *name;
+	int cpu;		/* -1: not pinned */
+	int fifo;		/* SCHED_FIFO with -F */
+	uint64_t busy_us;
+};
+
+static struct {
+	int enabled;
+	int fifo;		/* SCHED_FIFO I/O threads, performance governor */
+	struct pipe_stage stage[PIPE_STAGES];
+	struct pipe_queue q[PIPE_STAGES - 1];
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	int pending;		/* jobs not written yet */
+	int err;		/* first write error since WOpen */
+	uint32_t crc;		/* of the data in arrival order */
+	uint64_t bytes, start;
+	char governor[PIPE_MAX_POLICIES][32];
+} g_pipe = {
+	.stage = {
+		{ "rx", -1, 1 },
+		{ "hash", -1, 0 },
+		{ "write", -1, 1 },
+	},
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+};
+
+static void queue_push(struct pipe_queue *q, struct pipe_job *job)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == PIPE_DEPTH)
+		pthread_cond_wait(&q->cond, &q->lock);
+	q->job[(q->head + q->count++) % PIPE_DEPTH] = *job;
+	q->pushes++;
+	q->depth_sum += q->count;
+	if (q->count > q->depth_max)
+		q->depth_max = q->count;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_pop(struct pipe_queue *q, struct pipe_job *job)
+{
+	pthread_mutex_lock(&q->lock);
+	while (!q->count)
+		pthread_cond_wait(&q->cond, &q->lock);
+	*job = q->job[q->head];
+	q->head = (q->head + 1) % PIPE_DEPTH;
+	q->count--;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void *pipe_hash(void *arg)
+{
+	struct pipe_job job;
+	uint64_t start;
+
+	while (1) {
+		queue_pop(&g_pipe.q[0], &job);
+		start = now_us();
+		g_pipe.crc = crc32(g_pipe.crc, job.p, job.len);
+		g_pipe.stage[STAGE_HASH].busy_us += now_us() - start;
+		queue_push(&g_pipe.q[1], &job);
+	}
+	return NULL;
+}
+
+static void *pipe_write(void *arg)
+{
+	struct pipe_job job;
+	uint64_t start;
+	int ret;
+
+	while (1) {
+		queue_pop(&g_pipe.q[1], &job);
+		start = now_us();
+		ret = sink_write(&g_blk, job.fd, job.p, job.len,
+				 job.off < 0 ? NULL : &job.off);
+		g_pipe.stage[STAGE_WRITE].busy_us += now_us() - start;
+		free(job.p);
+
+		pthread_mutex_lock(&g_pipe.lock);
+		if (ret < 0 && !g_pipe.err) {
+			printf("pipeline write failed: %s\n", strerror(-ret));
+			g_pipe.err = ret;
+		}
+		if (!--g_pipe.pending)
+			pthread_cond_broadcast(&g_pipe.idle);
+		pthread_mutex_unlock(&g_pipe.lock);
+	}
+	return NULL;
+}
+
+/* pin the calling thread, and make it real time if asked to */
+static void pipe_setup_thread(struct pipe_stage *st)
+{
+	struct sched_param param = { .sched_priority = 10 };
+	cpu_set_t set;
+
+	if (st->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(st->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			printf("%s: can't pin to cpu %d\n", st->name, st->cpu);
+	}
+	if (g_pipe.fifo && st->fifo &&
+	    pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+		printf("%s: can't use SCHED_FIFO\n", st->name);
+}
+
+static void *pipe_thread(void *arg)
+{
+	struct pipe_stage *st = arg;
+
+	pipe_setup_thread(st);
+	return st == &g_pipe.stage[STAGE_HASH] ? pipe_hash(NULL) : pipe_write(NULL);
+}
+
+static int pipe_start(void)
+{
+	pthread_t thread;
+	int i;
+
+	for (i = 0; i < PIPE_STAGES - 1; i++) {
+		pthread_mutex_init(&g_pipe.q[i].lock, NULL);
+		pthread_cond_init(&g_pipe.q[i].cond, NULL);
+	}
+	pipe_setup_thread(&g_pipe.stage[STAGE_RX]);
+	for (i = STAGE_HASH; i < PIPE_STAGES; i++) {
+		if (pthread_create(&thread, NULL, pipe_thread, &g_pipe.stage[i]))
+			return -1;
+		pthread_detach(thread);
+	}
+	return 0;
+}
+
+/* "performance" cpufreq governor while flashing with -F, restored at Close */
+static void pipe_governor(int flash)
+{
+	char path[128], buf[32];
+	int i, fd, n;
+
+	for (i = 0; i < PIPE_MAX_POLICIES; i++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpufreq/policy%d/scaling_governor", i);
+		fd = open(path, O_RDWR);
+		if (fd < 0)
+			continue;
+		if (flash) {
+			n = read(fd, buf, sizeof(buf) - 1);
+			buf[n > 0 ? n : 0] = 0;
+			buf[strcspn(buf, "\n")] = 0;
+			snprintf(g_pipe.governor[i], sizeof(g_pipe.governor[i]), "%s", buf);
+			write(fd, "performance", 11);
+		} else if (g_pipe.governor[i][0]) {
+			write(fd, g_pipe.governor[i], strlen(g_pipe.governor[i]));
+			g_pipe.governor[i][0] = 0;
+		}
+		close(fd);
+	}
+}
+
+/* a new target was opened */
+static void pipe_begin(void)
+{
+	int i;
+
+	g_pipe.err = 0;
+	g_pipe.crc = 0;
+	g_pipe.bytes = 0;
+	g_pipe.start = now_us();
+	for (i = 0; i < PIPE_STAGES; i++)
+		g_pipe.stage[i].busy_us = 0;
+	for (i = 0; i < PIPE_STAGES - 1; i++)
+		g_pipe.q[i].pushes = g_pipe.q[i].depth_sum = g_pipe.q[i].depth_max = 0;
+	if (g_pipe.fifo)
+		pipe_governor(1);
+}
+
+static void pipe_queue_job(uint8_t *p, size_t len, int fd, off_t off)
+{
+	struct pipe_job job = { p, len, fd, off };
+
+	pthread_mutex_lock(&g_pipe.lock);
+	g_pipe.pending++;
+	pthread_mutex_unlock(&g_pipe.lock);
+	g_pipe.bytes += len;
+	queue_push(&g_pipe.q[0], &job);
+}
+
+/* downloads the pipeline hasn't written yet */
+static int pipe_pending(void)
+{
+	int n;
+
+	pthread_mutex_lock(&g_pipe.lock);
+	n = g_pipe.pending;
+	pthread_mutex_unlock(&g_pipe.lock);
+	return n;
+}
+
+static int pipe_drain(void)
+{
+	pthread_mutex_lock(&g_pipe.lock);
+	while (g_pipe.pending)
+		pthread_cond_wait(&g_pipe.idle, &g_pipe.lock);
+	pthread_mutex_unlock(&g_pipe.lock);
+	return g_pipe.err;
+}
+
+/* occupancy report, busy is the share of the time since WOpen */
+static void pipe_report(void)
+{
+	uint64_t elapsed = now_us() - g_pipe.start;
+	struct pipe_queue *q;
+	int i;
+
+	send_info("crc32=%08x bytes=%llu", g_pipe.crc, (unsigned long long)g_pipe.bytes);
+	for (i = 0; i < PIPE_STAGES; i++)
+		send_info("%s cpu=%d busy=%llu%%", g_pipe.stage[i].name, g_pipe.stage[i].cpu,
+			  (unsigned long long)(g_pipe.stage[i].busy_us * 100 / (elapsed ? elapsed : 1)));
+	for (i = 0; i < PIPE_STAGES - 1; i++) {
+		q = &g_pipe.q[i];
+		send_info("%s->%s queue avg=%llu.%llu max=%d/%d", g_pipe.stage[i].name,
+			  g_pipe.stage[i + 1].name,
+			  (unsigned long long)(q->pushes ? q->depth_sum / q->pushes : 0),
+			  (unsigned long long)(q->pushes ? q->depth_sum * 10 / q->pushes % 10 : 0),
+			  q->depth_max, PIPE_DEPTH);
+	}
+}
+
+/*
+ * Content addressed cache, "ufb -C <dir>" with <dir> on tmpfs or the
+ * initramfs: the data downloaded between WOpen: and Close is also kept
+ * as <dir>/<sha256>. CacheHas:<sha256> tells the host whether a blob is
+ * there, CacheWrite:<sha256> writes it to the open target so it doesn't
+ * cross USB again. Least recently used blobs are dropped while free
+ * memory is short; a blob that doesn't fit is simply not kept.
+ */
+#define CACHE_MIN_FREE	(128ULL << 20)
+
+static struct {
+	const char *dir;
+	pthread_mutex_t lock;
+	int fd;			/* blob being collected, -1 if none */
+	char tmp[256];
+	struct sha256_ctx sha;
+} g_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+/* <dir>/<sha256>, from 64 hex digits */
+static int cache_path(char *path, size_t size, const char *hex)
+{
+	char name[65];
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		if (!isxdigit((unsigned char)hex[i]))
+			return -1;
+		name[i] = tolower((unsigned char)hex[i]);
+	}
+	name[64] = 0;
+	snprintf(path, size, "%s/%s", g_cache.dir, name);
+	return 0;
+}
+
+/* drop the least recently used blob, -1 when there is none left */
+static int cache_evict(void)
+{
+	char path[512], victim[512] = "";
+	struct timespec oldest = { 0 };
+	struct dirent *d;
+	struct stat st;
+	DIR *dir;
+
+	dir = opendir(g_cache.dir);
+	while (dir && (d = readdir(dir))) {
+		if (strlen(d->d_name) != 64)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", g_cache.dir, d->d_name);
+		if (stat(path, &st))
+			continue;
+		if (!victim[0] || st.st_mtim.tv_sec < oldest.tv_sec ||
+		    (st.st_mtim.tv_sec == oldest.tv_sec && st.st_mtim.tv_nsec < oldest.tv_nsec)) {
+			oldest = st.st_mtim;
+			strcpy(victim, path);
+		}
+	}
+	if (dir)
+		closedir(dir);
+	if (!victim[0])
+		return -1;
+	printf("cache: evict %s\n", victim);
+	return unlink(victim);
+}
+
+static void cache_abandon_locked(void)
+{
+	if (g_cache.fd < 0)
+		return;
+	close(g_cache.fd);
+	unlink(g_cache.tmp);
+	g_cache.fd = -1;
+}
+
+static void cache_abandon(void)
+{
+	pthread_mutex_lock(&g_cache.lock);
+	cache_abandon_locked();
+	pthread_mutex_unlock(&g_cache.lock);
+}
+
+/* WOpen: starts collecting a new blob */
+static void cache_begin(void)
+{
+	if (!g_cache.dir)
+		return;
+	pthread_mutex_lock(&g_cache.lock);
+	cache_abandon_locked();
+	snprintf(g_cache.tmp, sizeof(g_cache.tmp), "%s/.blob-XXXXXX", g_cache.dir);
+	g_cache.fd = mkstemp(g_cache.tmp);
+	sha256_init(&g_cache.sha);
+	pthread_mutex_unlock(&g_cache.lock);
+}
+
+static void cache_add(const void *p, size_t len)
+{
+	pthread_mutex_lock(&g_cache.lock);
+	if (g_cache.fd >= 0) {
+		while (mem_available() < len + CACHE_MIN_FREE) {
+			if (cache_evict()) {
+				printf("cache: out of memory, blob not kept\n");
+				cache_abandon_locked();
+				goto out;
+			}
+		}
+		if (write_at(g_cache.fd, p, len, NULL))
+			cache_abandon_locked();
+		else
+			sha256_update(&g_cache.sha, p, len);
+	}
+out:
+	pthread_mutex_unlock(&g_cache.lock);
+}
+
+/* Close: keep the blob under its hash, which goes to 'hex' */
+static int cache_end(char *hex)
+{
+	char path[512];
+	uint8_t digest[32];
+	int i, ret = -1;
+
+	pthread_mutex_lock(&g_cache.lock);
+	if (g_cache.fd >= 0 && g_cache.sha.len) {
+		sha256_final(&g_cache.sha, digest);
+		for (i = 0; i < 32; i++)
+			sprintf(hex + 2 * i, "%02x", digest[i]);
+		snprintf(path, sizeof(path), "%s/%s", g_cache.dir, hex);
+		close(g_cache.fd);
+		g_cache.fd = -1;
+		ret = rename(g_cache.tmp, path);
+		if (ret)
+			unlink(g_cache.tmp);
+	}
+	cache_abandon_locked();
+	pthread_mutex_unlock(&g_cache.lock);
+	return ret;
+}
+
+/* copy a blob to fd at its current position, returns bytes or -errno */
+static ssize_t cache_write(const char *hex, int fd)
+{
+	char path[512], buf[65536];
+	ssize_t n, total = 0;
+	int in, ret = 0;
+
+	if (cache_path(path, sizeof(path), hex))
+		return -EINVAL;
+	in = open(path, O_RDONLY);
+	if (in < 0)
+		return -errno;
+	futimens(in, NULL);
+
+	while (1) {
+		n = sendfile(fd, in, NULL, 1 << 30);
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			/* targets sendfile can't write to */
+			n = read(in, buf, sizeof(buf));
+			if (n > 0)
+				ret = write_at(fd, buf, n, NULL);
+		} else if (n < 0 && errno == EAGAIN) {
+			struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		if (n < 0)
+			ret = -errno;
+		if (n <= 0 || ret)
+			break;
+		total += n;
+	}
+	close(in);
+	return ret ? ret : total;
+}
+
+/*
+ * Transfer journal, "ufb -J <dir>" with <dir> somewhere that outlives
+ * ufb: each chunk downloaded to the target of WOpen: is recorded in
+ * <dir>/<hash of the target path>.jnl with its offset and CRC-32. After
+ * a reset, Resume:<target> checks the recorded chunks against what the
+ * target holds and answers with the end of the verified data from offset
+ * 0; WOpen: of that target then continues the journal and Seek:<offset>
+ * positions it. A successful Close removes the journal.
+ */
+#define JOURNAL_MAGIC	"UFBJ"
+
+struct journal_rec {
+	uint64_t off;
+	uint32_t len;
+	uint32_t crc;
+};
+
+static struct {
+	const char *dir;
+	int fd;			/* journal of the open target, -1 if none */
+	char path[256];
+	char resume[256];	/* target verified by Resume: */
+	off_t resume_end;	/* and the end of its verified data */
+	off_t pos;		/* where downloads without offset go */
+} g_journal = {
+	.fd = -1,
+};
+
+static void journal_path(char *path, size_t size, const char *target)
+{
+	struct sha256_ctx sha;
+	uint8_t digest[32];
+
+	sha256_init(&sha);
+	sha256_update(&sha, target, strlen(target));
+	sha256_final(&sha, digest);
+	snprintf(path, size, "%s/%02x%02x%02x%02x%02x%02x%02x%02x.jnl", g_journal.dir,
+		 digest[0], digest[1], digest[2], digest[3], digest[4], digest[5],
+		 digest[6], digest[7]);
+}
+
+static int journal_header(int fd, const char *target)
+{
+	uint32_t len = strlen(target);
+
+	if (write_at(fd, JOURNAL_MAGIC, 4, NULL) || write_at(fd, &len, sizeof(len), NULL) ||
+	    write_at(fd, target, len, NULL))
+		return -1;
+	return 0;
+}
+
+/* WOpen: starts a new journal, or continues the one Resume: verified */
+static void journal_begin(const char *target)
+{
+	if (!g_journal.dir)
+		return;
+
+	journal_path(g_journal.path, sizeof(g_journal.path), target);
+	g_journal.fd = -1;
+	if (strcmp(g_journal.resume, target) == 0)
+		g_journal.fd = open(g_journal.path, O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (g_journal.fd < 0) {
+		g_journal.fd = open(g_journal.path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+				    0600);
+		if (g_journal.fd >= 0 && journal_header(g_journal.fd, target)) {
+			close(g_journal.fd);
+			g_journal.fd = -1;
+		}
+	}
+	if (g_journal.fd < 0)
+		printf("journal: can't open %s: %s\n", g_journal.path, strerror(errno));
+	g_journal.resume[0] = '\0';
+	g_journal.pos = 0;
+}
+
+static void journal_add(uint64_t off, uint32_t len, uint32_t crc)
+{
+	struct journal_rec rec = { off, len, crc };
+
+	if (write_at(g_journal.fd, &rec, sizeof(rec), NULL)) {
+		printf("journal: write failed, not journaling any more\n");
+		close(g_journal.fd);
+		g_journal.fd = -1;
+	}
+}
+
+/* Close: the journal is only kept for a transfer that didn't complete */
+static void journal_end(int done)
+{
+	if (g_journal.fd < 0)
+		return;
+	close(g_journal.fd);
+	g_journal.fd = -1;
+	if (done)
+		unlink(g_journal.path);
+}
+
+static int journal_rec_cmp(const void *a, const void *b)
+{
+	const struct journal_rec *x = a, *y = b;
+
+	return x->off < y->off ? -1 : x->off > y->off;
+}
+
+/*
+ * The end of the data from offset 0 that the target holds as journaled.
+ * The journal is rewritten with just the chunks verified, chunks that
+ * don't match are sent again after all.
+ */
+static int journal_verify(const char *target, uint64_t *end)
+{
+	struct journal_rec *rec = NULL;
+	char path[256], tmp[280], magic[4];
+	uint8_t *buf = NULL;
+	size_t n = 0, max = 0, i, kept = 0;
+	uint32_t len, bufsize = 0;
+	int fd, in, ret = -EINVAL;
+
+	*end = 0;
+	journal_path(path, sizeof(path), target);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -errno;
+	if (read_full(fd, magic, 4) || memcmp(magic, JOURNAL_MAGIC, 4) ||
+	    read_full(fd, &len, sizeof(len)) || len >= sizeof(tmp) ||
+	    read_full(fd, tmp, len) || (tmp[len] = 0, strcmp(tmp, target))) {
+		close(fd);
+		return -EINVAL;
+	}
+	while (1) {
+		if (n == max) {
+			struct journal_rec *more;
+
+			max = max ? max * 2 : 1024;
+			more = realloc(rec, max * sizeof(*rec));
+			if (!more) {
+				free(rec);
+				close(fd);
+				return -ENOMEM;
+			}
+			rec = more;
+		}
+		if (read_full(fd, &rec[n], sizeof(*rec)))
+			break;
+		n++;
+	}
+	close(fd);
+	qsort(rec, n, sizeof(*rec), journal_rec_cmp);
+
+	in = open(target, O_RDONLY);
+	if (in < 0) {
+		ret = -errno;
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		/* sent again, or overlapping what is verified */
+		if (rec[i].off != *end)
+			continue;
+		if (rec[i].len > bufsize) {
+			free(buf);
+			bufsize = rec[i].len;
+			buf = malloc(bufsize);
+			if (!buf) {
+				ret = -ENOMEM;
+				goto out_in;
+			}
+		}
+		if (pread(in, buf, rec[i].len, rec[i].off) != rec[i].len ||
+		    crc32(0, buf, rec[i].len) != rec[i].crc)
+			continue;
+		*end += rec[i].len;
+		rec[kept++] = rec[i];
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || journal_header(fd, target) ||
+	    write_at(fd, rec, kept * sizeof(*rec), NULL) || rename(tmp, path)) {
+		ret = -errno;
+		unlink(tmp);
+	} else {
+		ret = 0;
+		snprintf(g_journal.resume, sizeof(g_journal.resume), "%s", target);
+		g_journal.resume_end = *end;
+	}
+	if (fd >= 0)
+		close(fd);
+out_in:
+	close(in);
+out:
+	free(buf);
+	free(rec);
+	return ret;
+}
+
+/*
+ * Open targets: WOpen: and ROpen: also answer with a handle, which
+ * donwload:, upload and Close take as a "#<handle>" suffix. Without the
+ * suffix they work on the last opened target as before. USB downloads to
+ * a handle are queued to a writer thread of its own, so targets on
+ * different devices are written at the same time; their write errors
+ * are reported by Close. Unpositioned downloads with and without suffix
+ * to the same target don't mix: one fails while the writes of the other
+ * are still queued.
+ */
+#define MAX_HANDLES 8
+
+struct handle {
+	int used;
+	int fd;
+	int writer;		/* writer thread started */
+	pthread_t thread;
+	struct pipe_queue q;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	int err;		/* first write error */
+	int queued;		/* jobs not written yet */
+	uint64_t done_us;	/* when the last write finished */
+	struct blk_sink sink;
+};
+
+static struct handle g_handle[MAX_HANDLES];
+
+/* -1 if the table is full, the target then only works without suffix */
+static int handle_alloc(int fd)
+{
+	int i;
+
+	for (i = 0; i < MAX_HANDLES; i++) {
+		if (!g_handle[i].used) {
+			memset(&g_handle[i], 0, sizeof(g_handle[i]));
+			g_handle[i].used = 1;
+			g_handle[i].fd = fd;
+			blk_sink_init(&g_handle[i].sink, fd);
+			blk_sink_policy(&g_handle[i].sink, g_wb_every, g_direct);
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * The handle a command names with "#<handle>", or the one of the last
+ * opened target; -1 if that isn't a handle, -2 for a bad suffix.
+ */
+static int handle_of(const char *cmd)
+{
+	const char *h = strchr(cmd, '#');
+	char *end;
+	long i;
+
+	if (!h) {
+		for (i = 0; i < MAX_HANDLES; i++)
+			if (g_handle[i].used && g_handle[i].fd == g_open_file)
+				return i;
+		return -1;
+	}
+	i = strtol(h + 1, &end, 0);
+	if (end == h + 1 || i < 0 || i >= MAX_HANDLES || !g_handle[i].used)
+		return -2;
+	return i;
+}
+
+static void *handle_writer(void *arg)
+{
+	struct handle *h = arg;
+	struct pipe_job job;
+	int ret;
+
+	while (1) {
+		queue_pop(&h->q, &job);
+		if (!job.p)
+			break;
+		ret = sink_write(&h->sink, job.fd, job.p, job.len,
+				 job.off < 0 ? NULL : &job.off);
+		free(job.p);
+		h->done_us = now_us();
+
+		pthread_mutex_lock(&h->lock);
+		if (ret < 0 && !h->err)
+			h->err = ret;
+		h->queued--;
+		pthread_mutex_unlock(&h->lock);
+	}
+	return NULL;
+}
+
+/* hand a download over to the writer of the handle, which owns p then */
+static int handle_queue(struct handle *h, uint8_t *p, size_t len, off_t off)
+{
+	struct pipe_job job = { p, len, h->fd, off };
+
+	if (!h->writer) {
+		pthread_mutex_init(&h->q.lock, NULL);
+		pthread_cond_init(&h->q.cond, NULL);
+		pthread_mutex_init(&h->lock, NULL);
+		if (pthread_create(&h->thread, NULL, handle_writer, h))
+			return -1;
+		h->writer = 1;
+	}
+	pthread_mutex_lock(&h->lock);
+	h->queued++;
+	pthread_mutex_unlock(&h->lock);
+	queue_push(&h->q, &job);
+	return 0;
+}
+
+/* whether the writer of a handle on fd still has downloads to write */
+static int handle_busy(int fd)
+{
+	struct handle *h;
+	int i, busy = 0;
+
+	for (i = 0; i < MAX_HANDLES; i++) {
+		h = &g_handle[i];
+		if (!h->used || h->fd != fd || !h->writer)
+			continue;
+		pthread_mutex_lock(&h->lock);
+		busy |= h->queued > 0;
+		pthread_mutex_unlock(&h->lock);
+	}
+	return busy;
+}
+
+/* wait for the writer, close the target, returns the first write error */
+static int handle_close(int i)
+{
+	struct handle *h = &g_handle[i];
+	struct pipe_job stop = { NULL };
+	int ret;
+
+	if (h->writer) {
+		queue_push(&h->q, &stop);
+		pthread_join(h->thread, NULL);
+	}
+	ret = blk_sink_close(&h->sink);
+	if (ret && !h->err)
+		h->err = ret;
+	if (h->fd == g_open_file)
+		g_open_file = -1;
+	ring_forget(h->fd);
+	close(h->fd);
+	h->used = 0;
+	return h->err;
+}
+
+/*
+ * Manifest flashing: Manifest:<hex size> takes, like a donwload:, a text
+ * with one partition per line
+ *
+ *	<target> <hex offset> <hex size> raw|sparse|gzip [<sha256>]
+ *
+ * size being the bytes sent for it and sha256 their digest. The answer
+ * is the order to send the payloads in, an INFO "send <n>" each: the
+ * device with the most left goes next, another one than the last when
+ * there is one, so a device's writer drains while the link feeds the
+ * next. The payloads then come as plain donwload:s, each partition
+ * taking its bytes and the next one the rest, and Done reports the time
+ * of every partition and whether its digest matched. Hardware boot
+ * partitions are writable for the session, sparse images are expanded
+ * here and gzip ones by a gzip child writing the target.
+ */
+#define MAX_PARTS	32
+
+#define FMT_RAW		0
+#define FMT_SPARSE	1
+#define FMT_GZIP	2
+
+#define SPARSE_MAGIC		0xed26ff3a
+#define SPARSE_RAW		0xcac1
+#define SPARSE_FILL		0xcac2
+#define SPARSE_DONT_CARE	0xcac3
+#define SPARSE_CRC32		0xcac4
+
+struct sparse_header {
+	uint32_t magic;
+	uint16_t major, minor;
+	uint16_t file_hdr_sz;
+	uint16_t chunk_hdr_sz;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	uint32_t total_chunks;
+	uint32_t image_checksum;
+};
+
+struct chunk_header {
+	uint16_t type;
+	uint16_t reserved;
+	uint32_t chunk_sz;	/* blocks */
+	uint32_t total_sz;	/* bytes, with this header */
+};
+
+/* an Android sparse image being expanded as it streams through */
+struct sparse {
+	uint8_t hdr[64];	/* header being collected */
+	size_t have, need;
+	int started;		/* file header seen */
+	uint32_t blksz;
+	uint16_t chunk_hdr;
+	uint32_t chunks;	/* left */
+	struct chunk_header ch;	/* the chunk of the header or data */
+	uint64_t left;		/* raw data of the chunk still to come */
+	uint64_t pos;		/* of the output */
+};
+
+struct part {
+	char target[128];
+	char dev[32];		/* partitions with the same one share a device */
+	char force_ro[96];	/* of a boot partition, set again at Done */
+	uint64_t offset, size;
+	int format;
+	char digest[65];	/* expected, "" if none */
+	struct sha256_ctx sha;
+	struct sparse sp;
+	int handle;		/* -1 before its data and once closed */
+	pid_t child;		/* gzip */
+	uint64_t got;
+	uint64_t start_us, us;
+	int err;
+};
+
+static struct {
+	int count;
+	int next;		/* in order, of the partition receiving */
+	int order[MAX_PARTS];
+	uint64_t start_us;
+	struct part part[MAX_PARTS];
+} g_manifest;
+
+static void sysfs_write(const char *path, const char *val)
+{
+	int fd = open(path, O_WRONLY);
+
+	if (fd < 0 || write(fd, val, strlen(val)) < 0)
+		printf("can't write %s to %s\n", val, path);
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * Which device a target is on: the disk of a partition, the card of an
+ * eMMC boot partition, the filesystem of a file.
+ */
+static void part_device(struct part *pt)
+{
+	char path[160], link[256], *name, *s;
+	struct stat st;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "%s", pt->target);
+	while (stat(path, &st)) {
+		/* a file yet to be created, by its directory */
+		s = strrchr(path, '/');
+		if (!s || s == path) {
+			snprintf(pt->dev, sizeof(pt->dev), "/");
+			return;
+		}
+		*s = '\0';
+	}
+	if (!S_ISBLK(st.st_mode)) {
+		if (S_ISCHR(st.st_mode))
+			snprintf(pt->dev, sizeof(pt->dev), "char%u", major(st.st_rdev));
+		else
+			snprintf(pt->dev, sizeof(pt->dev), "fs%lx", (unsigned long)st.st_dev);
+		return;
+	}
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(st.st_rdev),
+		 minor(st.st_rdev));
+	n = readlink(path, link, sizeof(link) - 1);
+	if (n < 0) {
+		snprintf(pt->dev, sizeof(pt->dev), "blk%u", major(st.st_rdev));
+		return;
+	}
+	link[n] = '\0';
+	strcat(path, "/partition");
+	if (!access(path, F_OK)) {
+		s = strrchr(link, '/');
+		if (s)
+			*s = '\0';
+	}
+	name = strrchr(link, '/');
+	name = name ? name + 1 : link;
+	s = strstr(name, "boot");
+	if (!strncmp(name, "mmcblk", 6) && s) {
+		snprintf(pt->force_ro, sizeof(pt->force_ro), "/sys/block/%.64s/force_ro", name);
+		*s = '\0';
+	}
+	snprintf(pt->dev, sizeof(pt->dev), "%.31s", name);
+}
+
+static int manifest_parse(char *text)
+{
+	char fmt[8], digest[80], *line, *save;
+	unsigned long long off, size;
+	struct part *pt;
+	int i, n;
+
+	for (line = strtok_r(text, "\r\n", &save); line; line = strtok_r(NULL, "\r\n", &save)) {
+		if (*line == '#')
+			continue;
+		if (g_manifest.count == MAX_PARTS)
+			return -E2BIG;
+		pt = &g_manifest.part[g_manifest.count];
+		memset(pt, 0, sizeof(*pt));
+		digest[0] = '\0';
+		n = sscanf(line, "%127s %llx %llx %7s %79s", pt->target, &off, &size, fmt, digest);
+		if (n < 4)
+			return -EINVAL;
+		if (!strcmp(fmt, "raw"))
+			pt->format = FMT_RAW;
+		else if (!strcmp(fmt, "sparse"))
+			pt->format = FMT_SPARSE;
+		else if (!strcmp(fmt, "gzip"))
+			pt->format = FMT_GZIP;
+		else
+			return -EINVAL;
+		if (n == 5) {
+			for (i = 0; i < 64; i++) {
+				if (!isxdigit((unsigned char)digest[i]))
+					return -EINVAL;
+				pt->digest[i] = tolower((unsigned char)digest[i]);
+			}
+			if (digest[64])
+				return -EINVAL;
+		}
+		pt->offset = off;
+		pt->size = size;
+		pt->handle = -1;
+		sha256_init(&pt->sha);
+		pt->sp.need = sizeof(struct sparse_header);
+		part_device(pt);
+		g_manifest.count++;
+	}
+	return g_manifest.count ? 0 : -EINVAL;
+}
+
+/* the device with the most left goes next, not the last one if possible */
+static void manifest_plan(void)
+{
+	int planned[MAX_PARTS] = { 0 };
+	uint64_t left, best_left;
+	int i, j, k, best, last = -1;
+
+	for (k = 0; k < g_manifest.count; k++) {
+		best = -1;
+		best_left = 0;
+		for (i = 0; i < g_manifest.count; i++) {
+			struct part *pt = &g_manifest.part[i];
+
+			/* a device's partitions go in the order of the manifest */
+			for (j = 0; j < i; j++)
+				if (!planned[j] && !strcmp(g_manifest.part[j].dev, pt->dev))
+					break;
+			if (planned[i] || j < i)
+				continue;
+			left = 0;
+			for (j = i; j < g_manifest.count; j++)
+				if (!planned[j] && !strcmp(g_manifest.part[j].dev, pt->dev))
+					left += g_manifest.part[j].size;
+			if (best >= 0) {
+				int same = last >= 0 &&
+					   !strcmp(pt->dev, g_manifest.part[last].dev);
+				int best_same = last >= 0 &&
+						!strcmp(g_manifest.part[best].dev,
+							g_manifest.part[last].dev);
+
+				if (same > best_same || (same == best_same && left <= best_left))
+					continue;
+			}
+			best = i;
+			best_left = left;
+		}
+		planned[best] = 1;
+		g_manifest.order[k] = best;
+		last = best;
+	}
+}
+
+/* gzip writes the target from the offset on, the handle feeds it */
+static int part_gzip(struct part *pt, int fd)
+{
+	int p[2];
+
+	if (lseek(fd, pt->offset, SEEK_SET) < 0 || pipe2(p, O_CLOEXEC))
+		return -1;
+	pt->child = fork();
+	if (pt->child == 0) {
+		dup2(p[0], STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		execlp("gzip", "gzip", "-dc", NULL);
+		perror("gzip");
+		_exit(127);
+	}
+	close(p[0]);
+	if (pt->child < 0) {
+		close(p[1]);
+		return -1;
+	}
+	close(fd);
+	return p[1];
+}
+
+static void part_close(struct part *pt)
+{
+	struct handle *h = &g_handle[pt->handle];
+	int status, err;
+
+	err = handle_close(pt->handle);
+	if (err && !pt->err)
+		pt->err = err;
+	if (h->done_us > pt->start_us)
+		pt->us = h->done_us - pt->start_us;
+	pt->handle = -1;
+	if (pt->child > 0) {
+		if (waitpid(pt->child, &status, 0) != pt->child || !WIFEXITED(status) ||
+		    WEXITSTATUS(status)) {
+			if (!pt->err)
+				pt->err = -EIO;
+		}
+		pt->us = now_us() - pt->start_us;
+		pt->child = 0;
+	}
+}
+
+static int part_open(struct part *pt)
+{
+	int fd, i, n = g_manifest.count;
+
+	if (pt->force_ro[0])
+		sysfs_write(pt->force_ro, "0");
+	fd = open(pt->target, O_WRONLY | O_CREAT | O_CLOEXEC,
+		  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	if (fd < 0)
+		return -errno;
+	if (pt->format == FMT_GZIP) {
+		int in = part_gzip(pt, fd);
+
+		if (in < 0) {
+			close(fd);
+			return -errno;
+		}
+		fd = in;
+	}
+
+	pt->handle = handle_alloc(fd);
+	/* the table is full, make room: a partition done on this device first */
+	for (i = 0; pt->handle < 0 && i < 2 * n; i++) {
+		struct part *o = &g_manifest.part[i % n];
+
+		if (o->handle >= 0 && o->got == o->size && (i >= n || !strcmp(o->dev, pt->dev))) {
+			part_close(o);
+			pt->handle = handle_alloc(fd);
+		}
+	}
+	if (pt->handle < 0) {
+		close(fd);
+		if (pt->child > 0) {
+			kill(pt->child, SIGKILL);
+			waitpid(pt->child, NULL, 0);
+			pt->child = 0;
+		}
+		return -EMFILE;
+	}
+	return 0;
+}
+
+/* a copy of the data for the writer of the partition, at off or in order */
+static int part_queue(struct part *pt, const void *p, size_t len, off_t off)
+{
+	struct handle *h = &g_handle[pt->handle];
+	uint8_t *copy;
+
+	if (h->err)
+		return h->err;
+	copy = malloc(len);
+	if (!copy)
+		return -ENOMEM;
+	memcpy(copy, p, len);
+	if (handle_queue(h, copy, len, off)) {
+		free(copy);
+		return -EAGAIN;
+	}
+	return 0;
+}
+
+static int sparse_fill(struct part *pt, uint32_t val, uint64_t len)
+{
+	size_t n = len < (1 << 20) ? len : (1 << 20), i;
+	uint32_t *buf = malloc(n);
+	int ret = 0;
+
+	if (!buf)
+		return -ENOMEM;
+	for (i = 0; i < n / 4; i++)
+		buf[i] = val;
+	while (len && !ret) {
+		if (n > len)
+			n = len;
+		ret = part_queue(pt, buf, n, pt->offset + pt->sp.pos);
+		pt->sp.pos += n;
+		len -= n;
+	}
+	free(buf);
+	return ret;
+}
+
+/* what a header that is complete says */
+static int sparse_header(struct part *pt)
+{
+	struct sparse *sp = &pt->sp;
+	struct sparse_header fh;
+	uint32_t val;
+	uint64_t len;
+	int ret;
+
+	if (!sp->started) {
+		memcpy(&fh, sp->hdr, sizeof(fh));
+		if (le32_to_cpu(fh.magic) != SPARSE_MAGIC || le16_to_cpu(fh.major) != 1 ||
+		    le16_to_cpu(fh.file_hdr_sz) < sizeof(fh) ||
+		    le16_to_cpu(fh.file_hdr_sz) > sizeof(sp->hdr) ||
+		    le16_to_cpu(fh.chunk_hdr_sz) < sizeof(sp->ch) ||
+		    le16_to_cpu(fh.chunk_hdr_sz) > sizeof(sp->hdr) - 4 ||
+		    !fh.blk_sz || le32_to_cpu(fh.blk_sz) % 4)
+			return -EINVAL;
+		/* the header may be longer than the fields known */
+		if (sp->need < le16_to_cpu(fh.file_hdr_sz)) {
+			sp->need = le16_to_cpu(fh.file_hdr_sz);
+			return 0;
+		}
+		sp->started = 1;
+		sp->blksz = le32_to_cpu(fh.blk_sz);
+		sp->chunk_hdr = le16_to_cpu(fh.chunk_hdr_sz);
+		sp->chunks = le32_to_cpu(fh.total_chunks);
+		sp->have = 0;
+		sp->need = sp->chunk_hdr;
+		return 0;
+	}
+
+	memcpy(&sp->ch, sp->hdr, sizeof(sp->ch));
+	len = (uint64_t)le32_to_cpu(sp->ch.chunk_sz) * sp->blksz;
+	switch (le16_to_cpu(sp->ch.type)) {
+	case SPARSE_RAW:
+		if (le32_to_cpu(sp->ch.total_sz) != sp->chunk_hdr + len)
+			return -EINVAL;
+		sp->left = len;
+		break;
+	case SPARSE_FILL:
+	case SPARSE_CRC32:
+		if (le32_to_cpu(sp->ch.total_sz) != sp->chunk_hdr + 4)
+			return -EINVAL;
+		/* the value follows the header */
+		if (sp->need == sp->chunk_hdr) {
+			sp->need += 4;
+			return 0;
+		}
+		memcpy(&val, sp->hdr + sp->chunk_hdr, 4);
+		if (le16_to_cpu(sp->ch.type) == SPARSE_FILL) {
+			ret = sparse_fill(pt, le32_to_cpu(val), len);
+			if (ret)
+				return ret;
+		}
+		break;
+	case SPARSE_DONT_CARE:
+		sp->pos += len;
+		break;
+	default:
+		return -EINVAL;
+	}
+	sp->chunks--;
+	sp->have = 0;
+	sp->need = sp->chunk_hdr;
+	return 0;
+}
+
+static int sparse_feed(struct part *pt, const uint8_t *p, size_t len)
+{
+	struct sparse *sp = &pt->sp;
+	size_t n;
+	int ret;
+
+	while (len) {
+		if (sp->left) {
+			n = len < sp->left ? len : sp->left;
+			ret = part_queue(pt, p, n, pt->offset + sp->pos);
+			if (ret)
+				return ret;
+			sp->pos += n;
+			sp->left -= n;
+		} else {
+			/* nothing may follow the last chunk */
+			if (sp->started && !sp->chunks)
+				return -EINVAL;
+			n = sp->need - sp->have;
+			if (n > len)
+				n = len;
+			memcpy(sp->hdr + sp->have, p, n);
+			sp->have += n;
+			if (sp->have == sp->need) {
+				ret = sparse_header(pt);
+				if (ret)
+					return ret;
+			}
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* on to the next partition that still takes data */
+static void manifest_skip(void)
+{
+	struct part *pt;
 
-int g_stdin  = -1;
-int g_stdout = -1;
-int g_pid = -1;
-int g_ep_sink = -1;
-int g_ep_source = -1;
-int g_ep_0 = -1;
-int g_open_file = -1;
+	while (g_manifest.next < g_manifest.count) {
+		pt = &g_manifest.part[g_manifest.order[g_manifest.next]];
+		if (pt->got < pt->size)
+			break;
+		g_manifest.next++;
+	}
+}
 
-size_t round_up_to_cache_line(size_t size)
+/* a donwload: while the payloads of a manifest are due */
+static int manifest_feed(const uint8_t *p, size_t len)
 {
-	return (size + 0x7f) & ~0x7f;
+	struct part *pt;
+	size_t n;
+	int ret, err = 0;
+
+	while (len) {
+		/* more than the manifest announced */
+		if (g_manifest.next == g_manifest.count)
+			return -ENOSPC;
+		pt = &g_manifest.part[g_manifest.order[g_manifest.next]];
+		if (!pt->got) {
+			pt->start_us = now_us();
+			pt->err = part_open(pt);
+		}
+		n = len < pt->size - pt->got ? len : pt->size - pt->got;
+		sha256_update(&pt->sha, p, n);
+		if (!pt->err) {
+			if (pt->format == FMT_SPARSE)
+				ret = sparse_feed(pt, p, n);
+			else
+				ret = part_queue(pt, p, n, pt->format == FMT_RAW ?
+						 pt->offset + pt->got : -1);
+			if (ret)
+				pt->err = ret;
+		}
+		/* the rest of a failed partition is still taken */
+		if (pt->err)
+			err = pt->err;
+		pt->got += n;
+		p += n;
+		len -= n;
+		if (pt->got == pt->size)
+			manifest_skip();
+	}
+	return err;
 }
 
-void send_data(void *p, size_t size)
+/* close every partition, report it and make boot partitions read-only again */
+static int manifest_end(void)
 {
-	int r;
-	r = write(g_ep_sink, p, size);
-	if (r < 0)
-		printf("failure write to usb ep\n");
+	uint8_t digest[32];
+	const char *name, *res;
+	struct part *pt;
+	int i, j, failed = 0;
+	char hex[65];
+
+	for (i = 0; i < g_manifest.count; i++)
+		if (g_manifest.part[i].handle >= 0)
+			part_close(&g_manifest.part[i]);
+
+	for (i = 0; i < g_manifest.count; i++) {
+		pt = &g_manifest.part[i];
+		sha256_final(&pt->sha, digest);
+		for (j = 0; j < 32; j++)
+			sprintf(hex + 2 * j, "%02x", digest[j]);
+
+		res = "ok";
+		if (pt->got != pt->size)
+			res = "short";
+		else if (pt->err)
+			res = strerror(-pt->err);
+		else if (pt->format == FMT_SPARSE && (!pt->sp.started || pt->sp.chunks))
+			res = "truncated";
+		else if (pt->digest[0] && strcmp(hex, pt->digest))
+			res = "digest";
+		if (strcmp(res, "ok"))
+			failed++;
+
+		name = strrchr(pt->target, '/');
+		name = name ? name + 1 : pt->target;
+		printf("%s: %s\n", pt->target, res);
+		send_info("%d %.16s %llums %ukB/s %s", i, name,
+			  (unsigned long long)pt->us / 1000, kb_per_sec(pt->got, pt->us), res);
+		if (pt->force_ro[0])
+			sysfs_write(pt->force_ro, "1");
+	}
+	send_info("total %llums", (unsigned long long)(now_us() - g_manifest.start_us) / 1000);
+	g_manifest.count = 0;
+	return failed;
 }
 
 ssize_t write_file(int fp, void *p, size_t size)
@@ -355,6 +2272,10 @@ int handle_cmd(const char *cmd)
 	tv.tv_sec = 0;
 	tv.tv_usec = 50000;
 
+	/* everything but a download sees the data already written */
+	if (g_pipe.enabled && strncmp(cmd, "donwload:", 9))
+		pipe_drain();
+
 	if (strncmp(cmd, "UCmd:", 5) == 0)
 	{
 		printf("run shell cmd: %s\n", cmd + 5);
@@ -456,19 +2377,34 @@ int handle_cmd(const char *cmd)
 		g_stdin = g_stdout = -1;
 
 	} else if (strncmp(cmd, "WOpen:", 6) == 0) {
-		int rs = 4;
+		/* WOpen:<target>[,size=<hex size>] */
+		char file[256], *key, *end;
+		uint64_t hint = 0, keep = 0;
+		int rs = 4, direct = g_direct, err, bad = 0;
 		printf("WOpen:%s\n", cmd + 6);
-		if (cmd[6] == '-') {
+		snprintf(file, sizeof(file), "%s", cmd + 6);
+		key = strstr(file, ",size=");
+		if (key) {
+			hint = strtoull(key + 6, &end, 16);
+			/* rather than open some other path */
+			bad = !isxdigit((unsigned char)key[6]) || *end;
+			*key = '\0';
+		}
+		/* whatever is left of a target not closed, before its fd is reused */
+		blk_sink_close(&g_blk);
+		if (bad) {
+			printf("bad size hint\n");
+			g_open_file = -1;
+		} else if (file[0] == '-') {
 			g_open_file = g_stdin;
 		}
 		else {
-			const char *file = cmd + 6;
 			struct stat st;
 			if (stat(file, &st)) {
 				g_open_file = open(file, O_WRONLY | O_CREAT,
 				                   S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
 			} else {
-				if (st.st_mode & S_IFDIR) {
+				if (S_ISDIR(st.st_mode)) {
 					g_open_file = -1;
 					sprintf(fm.data, "%s", "DIR");
 					rs = 7;
@@ -478,10 +2414,45 @@ int handle_cmd(const char *cmd)
 				}
 			}
 		}
+		/* resuming, what Resume: verified stays */
+		if (strcmp(g_journal.resume, file) == 0)
+			keep = g_journal.resume_end;
+		if (g_open_file >= 0) {
+			err = wopen_prepare(g_open_file, hint, keep, &direct);
+			if (err) {
+				send_info("%s", strerror(-err));
+				if (g_open_file != g_stdin)
+					close(g_open_file);
+				g_open_file = -1;
+			}
+		}
 		if (g_open_file < 0)
 			fm.key = FAIL;
 		else
 			fm.key = OKAY;
+		blk_sink_init(&g_blk, g_open_file);
+		blk_sink_policy(&g_blk, g_wb_every, direct);
+		/* the pipeline writes from its own thread, the ring is ours */
+		if (!g_pipe.enabled)
+			blk_sink_ring(&g_blk, g_ring);
+		g_durable = 0;
+		/* just what the image is going to cover, so only when known */
+		if (g_blk.blk && g_prediscard && hint)
+			prediscard(g_open_file, keep, hint);
+		if (g_open_file >= 0 && g_pipe.enabled)
+			pipe_begin();
+		if (g_open_file >= 0) {
+			int h = handle_alloc(g_open_file);
+
+			cache_begin();
+			if (g_open_file != g_stdin)
+				journal_begin(file);
+			if (h >= 0) {
+				blk_sink_policy(&g_handle[h].sink, g_wb_every, direct);
+				sprintf(fm.data, "%d", h);
+				rs = 4 + strlen(fm.data);
+			}
+		}
 		send_data(&fm, rs);
 
 	} else if (strncmp(cmd, "ROpen:", 6) == 0) {
@@ -501,50 +2472,245 @@ int handle_cmd(const char *cmd)
 			rz = 4 + strlen(fm.data);
 		}
 
-		if (g_open_file < 0)
+		if (g_open_file < 0) {
 			fm.key = FAIL;
-		else
+		} else {
+			int h = handle_alloc(g_open_file);
+
 			fm.key = OKAY;
+			/* <size>,<handle>, hosts reading only the size still can */
+			if (h >= 0) {
+				sprintf(fm.data + rz - 4, "%s%d", rz > 4 ? "," : "", h);
+				rz = 4 + strlen(fm.data);
+			}
+		}
 		send_data(&fm, rz);
 
 	} else if (strncmp(cmd, "Close", 5) == 0) {
-		close(g_open_file);
-		g_open_file = -1;
+		/* Close[#<handle>] */
+		int h = handle_of(cmd), err;
+		char hex[65];
+
 		fm.key = OKAY;
+		if (h >= 0 && g_handle[h].fd != g_open_file) {
+			err = handle_close(h);
+			if (g_handle[h].sink.elided)
+				send_info("zero=0x%llx elided",
+					  (unsigned long long)g_handle[h].sink.elided);
+			if (err) {
+				send_info("write failed: %s", strerror(-err));
+				fm.key = FAIL;
+			}
+			send_data(&fm, 4);
+			return 0;
+		}
+		if (h == -2) {
+			fm.key = FAIL;
+			send_data(&fm, 4);
+			return 0;
+		}
+
+		if (g_cache.dir && cache_end(hex) == 0)
+			send_info("cached %.16s", hex);
+		if (g_pipe.enabled && g_open_file >= 0) {
+			pipe_report();
+			if (g_pipe.fifo)
+				pipe_governor(0);
+			if (g_pipe.err) {
+				send_info("write failed: %s", strerror(-g_pipe.err));
+				fm.key = FAIL;
+			}
+			g_pipe.err = 0;
+		}
+		err = blk_sink_close(&g_blk);
+		if (err) {
+			send_info("write failed: %s", strerror(-err));
+			fm.key = FAIL;
+		}
+		if (h >= 0) {
+			err = handle_close(h);
+			if (err) {
+				send_info("write failed: %s", strerror(-err));
+				fm.key = FAIL;
+			}
+			g_blk.elided += g_handle[h].sink.elided;
+		} else {
+			ring_forget(g_open_file);
+			close(g_open_file);
+		}
+		if (g_blk.elided)
+			send_info("zero=0x%llx elided", (unsigned long long)g_blk.elided);
+		journal_end(fm.key == OKAY);
+		blk_sink_init(&g_blk, -1);
+		g_open_file = -1;
 		send_data(&fm, 4);
 
 	} else if (strncmp(cmd, "donwload:", 9) == 0) {
-		uint32_t size;
+		/*
+		 * donwload:<hex size>[@<hex offset>][#<handle>][%<hex crc32>]
+		 * with an offset the data is written there, the file position
+		 * is left alone; data not matching its CRC is answered with
+		 * FAIL "CRC" and not written, the host sends it again
+		 */
+		uint32_t size, len, crc = 0;
+		int has_crc, journaled, verify, manifest;
+		off_t at;
 		ssize_t rs;
 		uint32_t key = OKAY;
 		int ret = 0;
+		uint64_t start, sink_start;
+		off_t offset = 0, *off = NULL;
+		void *p = NULL;
+		char *end;
+		struct handle *h = NULL;
+		int fd = g_open_file;
+
+		size = strtoul(cmd + 9, &end, 16);
+		if (*end == '@') {
+			offset = strtoull(end + 1, &end, 16);
+			off = &offset;
+		}
+		if (*end == '#') {
+			int i = handle_of(cmd);
 
-		size = strtoul(cmd + 9, NULL, 16);
-
-		void *p = malloc(round_up_to_cache_line(size));
-		if (p) {
-			fm.key = DATA;
-		} else {
+			if (i < 0) {
+				fm.key = FAIL;
+				send_data(&fm, 4);
+				return 0;
+			}
+			h = &g_handle[i];
+			fd = h->fd;
+		}
+		/* the pipeline and the handle writer both write at the file position */
+		if (!off && fd == g_open_file && (h ? pipe_pending() : handle_busy(fd))) {
+			printf("%s writes still queued, not mixing\n", h ? "pipeline" : "handle");
 			fm.key = FAIL;
 			send_data(&fm, 4);
-			return -1;
+			return 0;
+		}
+		end = strchr(cmd, '%');
+		has_crc = end != NULL;
+		if (has_crc)
+			crc = strtoul(end + 1, NULL, 16);
+		/* the payloads of a manifest come without offset or handle */
+		manifest = g_manifest.count && !off && !h;
+		journaled = g_journal.fd >= 0 && fd == g_open_file && !manifest;
+		verify = has_crc || journaled;
+		at = off ? offset : g_journal.pos;
+
+		if (!g_tcp || verify || manifest) {
+			p = malloc(round_up_to_cache_line(size));
+			if (!p) {
+				fm.key = FAIL;
+				send_data(&fm, 4);
+				return -1;
+			}
 		}
 
+		fm.key = DATA;
 		sprintf(fm.data, "%08X", size);
 		send_data(&fm, 4 + strlen(fm.data));
 
-		/* workaround for chipidea usb driver sg alignment issue */
-		if ((rs = read(g_ep_source, p, round_up_to_cache_line(size))) < 0)
-			key = FAIL;
+		start = now_us();
+		if (g_tcp) {
+			/* the data is a single message of exactly size bytes */
+			if (read_full(g_ep_source, &len, sizeof(len)) ||
+			    le32_to_cpu(len) != size) {
+				printf("bad data message\n");
+				return -1;
+			}
+			sink_start = start;
+			rs = size;
+			/* spliced data never passes through here to be kept */
+			cache_abandon();
+			if (verify || manifest) {
+				/* checked before it is written, no sink from here */
+				if (read_full(g_ep_source, p, size))
+					ret = -ECONNRESET;
+				else if (has_crc && crc32(0, p, size) != crc)
+					ret = -EBADMSG;
+				else if (manifest)
+					ret = manifest_feed(p, size);
+				else
+					ret = write_at(fd, p, size, off);
+			} else {
+				ret = splice_download(g_ep_source, fd, size, off);
+			}
+			if (ret == -ECONNRESET) {
+				free(p);
+				return -1;
+			}
+			if (!ret && journaled && !has_crc)
+				crc = crc32(0, p, size);
+			if (ret < 0)
+				key = FAIL;
+		} else {
+			/* workaround for chipidea usb driver sg alignment issue */
+			if (g_stripe)
+				rs = stripe_xfer(p, size, 0) ? -1 : size;
+			else
+				rs = read(g_ep_source, p, round_up_to_cache_line(size));
+			if (rs < 0)
+				key = FAIL;
 
-		if (rs != size) {
-			printf("read size %zd != %d\n", rs, size);
-			key = FAIL;
+			if (rs != size) {
+				printf("read size %zd != %d\n", rs, size);
+				key = FAIL;
+			}
+			if (key == OKAY && has_crc && crc32(0, p, rs) != crc) {
+				ret = -EBADMSG;
+				key = FAIL;
+			}
+			/* now, the pipeline or a handle may take p below */
+			if (key == OKAY && journaled && !has_crc)
+				crc = crc32(0, p, rs);
+
+			g_pipe.stage[STAGE_RX].busy_us += now_us() - start;
+			if (off && !h)
+				cache_abandon();
+			else if (key == OKAY && !h)
+				cache_add(p, rs);
+			sink_start = now_us();
+			if (manifest) {
+				if (key == OKAY)
+					ret = manifest_feed(p, rs);
+			} else if (h) {
+				/* as with the pipeline, Close reports write errors */
+				if (key == OKAY && !h->err && !handle_queue(h, p, rs, off ? *off : -1))
+					p = NULL;
+				else
+					key = FAIL;
+			} else if (g_pipe.enabled) {
+				/* a failure makes the host stop early, Close tells why */
+				if (key == OKAY && !g_pipe.err) {
+					pipe_queue_job(p, rs, g_open_file, off ? *off : -1);
+					p = NULL;
+				} else {
+					key = FAIL;
+				}
+			} else if (ret == -EBADMSG) {
+				/* not written, it comes again */
+			} else if (g_blk.managed && g_blk.fd == g_open_file)
+				ret = blk_sink_write(&g_blk, p, rs, off);
+			else if (!off)
+				ret = write_file(g_open_file, p, rs);
+			else if (rs > 0)
+				ret = write_at(g_open_file, p, rs, off);
+			if (ret < 0)
+				key = FAIL;
+		}
+
+		if (key == OKAY && journaled) {
+			journal_add(at, rs, crc);
+			if (!off)
+				g_journal.pos += rs;
 		}
 
-		ret = write_file(g_open_file, p, rs);
-		if (ret < 0)
-			key = FAIL;
+		/* positioned downloads may run in parallel, leave the stats alone */
+		if (key == OKAY && !off && !h) {
+			g_sink_rate = kb_per_sec(rs, now_us() - sink_start);
+			tuner_update(&g_tuner, rs, now_us() - start);
+		}
 
 		free(p);
 
@@ -562,17 +2728,31 @@ int handle_cmd(const char *cmd)
 				send_data(&fm, rs + 4);
 			}
 		}
+		/* progress the host can rely on, once per writeback window */
+		if (g_blk.durable != g_durable) {
+			g_durable = g_blk.durable;
+			send_info("durable=0x%llx", (unsigned long long)g_durable);
+		}
 		fm.key = key;
 		if (ret == -EPIPE) {
 			strcpy(fm.data, "EPIPE");
 			send_data(&fm, 4 + strlen("EPIPE"));
+		} else if (ret == -EBADMSG) {
+			printf("CRC mismatch\n");
+			strcpy(fm.data, "CRC");
+			send_data(&fm, 4 + strlen("CRC"));
 		} else {
 			send_data(&fm, 4);
 		}
 
 	} else if (strncmp(cmd, "upload", 6) == 0) {
-		int max = 0x10000;
+		/* upload[#<handle>], striped uploads give every pair up to 256 kB */
+		int h = handle_of(cmd);
+		int fd = !strchr(cmd, '#') ? g_open_file : h >= 0 ? g_handle[h].fd : -1;
+		int max = g_stripe ? g_stripe * 0x40000 : 0x10000;
 		void * p = malloc(max);
+		void *data;
+		int idx;
 		printf(".");
 		int ret  = 0;
 		if (p == NULL) {
@@ -580,7 +2760,7 @@ int handle_cmd(const char *cmd)
 			send_data(&fm, 4);
 		} else {
 			do {
-				ret = read(g_open_file, p, max);
+				ret = upload_read(fd, p, max, &data, &idx);
 				if (ret < 0) {
 					if( errno == EAGAIN) {
 						//retry read
@@ -596,14 +2776,302 @@ int handle_cmd(const char *cmd)
 					fm.key = DATA;
 					sprintf(fm.data, "%08X", ret);
 					send_data(&fm, 12);
-					send_data(p, ret);
 					fm.key = OKAY;
+					if (!g_stripe)
+						send_data(data, ret);
+					else if (stripe_xfer(data, ret, 1))
+						fm.key = FAIL;
 					send_data(&fm, 4);
+					if (idx >= 0)
+						uring_release(g_ring, idx);
 					break;
 				}
 			} while (1);
 		}
 		free(p);
+	} else if (strncmp(cmd, "Erase:", 6) == 0) {
+		/*
+		 * Erase:<dev>[,<hex offset>,<hex length>][,zero|discard|secure]
+		 * the whole device by default, discarded unless zeros are asked
+		 * for; INFO lines report the progress
+		 */
+		char arg[256], *dev, *tok, *save;
+		uint64_t v[2] = { 0, 0 }, start;
+		const char *method;
+		int mode = ERASE_DISCARD, n = 0, fd, ret;
+
+		snprintf(arg, sizeof(arg), "%s", cmd + 6);
+		dev = strtok_r(arg, ",", &save);
+		while ((tok = strtok_r(NULL, ",", &save))) {
+			if (strcmp(tok, "zero") == 0)
+				mode = ERASE_ZERO;
+			else if (strcmp(tok, "discard") == 0)
+				mode = ERASE_DISCARD;
+			else if (strcmp(tok, "secure") == 0)
+				mode = ERASE_SECURE;
+			else if (n < 2)
+				v[n++] = strtoull(tok, NULL, 16);
+		}
+
+		fd = dev ? open(dev, O_RDWR) : -1;
+		if (fd < 0) {
+			send_info("can't open %s: %s", dev ? dev : "", strerror(errno));
+			fm.key = FAIL;
+			send_data(&fm, 4);
+			return 0;
+		}
+		start = now_us();
+		ret = storage_erase(fd, v[0], v[1], mode, erase_progress, NULL, &method);
+		close(fd);
+		if (ret)
+			send_info("%s failed: %s", method, strerror(-ret));
+		else
+			send_info("erased by %s in %llu ms", method,
+				  (unsigned long long)(now_us() - start) / 1000);
+		memset(&fm, 0, sizeof(fm));
+		fm.key = ret ? FAIL : OKAY;
+		send_data(&fm, 4);
+
+	} else if (strncmp(cmd, "Selftest", 8) == 0) {
+		/*
+		 * Selftest[:<kB per device>[,rw]], devices are only read without rw
+		 * one INFO line per result, rates as in storage.h
+		 */
+		struct bench_result res;
+		struct bench_target *t;
+		unsigned long kb = 0;
+		char *opt = NULL;
+		int i;
+
+		if (cmd[8] == ':')
+			kb = strtoul(cmd + 9, &opt, 0);
+		send_info("selftest running");
+
+		storage_selftest(&res, kb * 1024, opt && strcmp(opt, ",rw") == 0);
+
+		send_info("mem memcpy=%u crc32=%u", res.memcpy_rate, res.crc32_rate);
+		for (i = 0; i < res.count; i++) {
+			t = &res.target[i];
+			send_info("%s %s size=%llu", t->name, t->type,
+				  (unsigned long long)t->size);
+			send_info("%s sr=%u sw=%u rr=%u rw=%u", t->name, t->seq_read,
+				  t->seq_write, t->rand_read, t->rand_write);
+		}
+		memset(&fm, 0, sizeof(fm));
+		fm.key = OKAY;
+		send_data(&fm, 4);
+
+	} else if (strncmp(cmd, "Caps", 4) == 0) {
+		/*
+		 * Caps
+		 * features, the largest buffer free memory allows, endpoint
+		 * max packet/burst, the sink rate in kB/s of the last download
+		 * and the download size currently giving the best throughput
+		 */
+		unsigned int in_mps, in_burst, out_mps, out_burst;
+		char line[MAX_FRAME_DATA_SIZE];
+		int i, len;
+
+		len = sprintf(line, "features=");
+		for (i = 0; g_features[i]; i++) {
+			if (len + strlen(g_features[i]) + 1 >= MAX_FRAME_DATA_SIZE) {
+				send_info("%s", line);
+				len = sprintf(line, "features=");
+			}
+			len += sprintf(line + len, "%s%s", len > 9 ? "," : "", g_features[i]);
+		}
+		send_info("%s", line);
+
+		g_tuner.max = max_buffer_size(MAX_XFER_SIZE);
+		if (g_tuner.size > g_tuner.max)
+			g_tuner.size = g_tuner.max;
+		send_info("maxbuf=0x%zx", g_tuner.max);
+
+		ep_caps(g_ep_sink, &in_mps, &in_burst);
+		ep_caps(g_ep_source, &out_mps, &out_burst);
+		send_info("in=%u/%u out=%u/%u", in_mps, in_burst, out_mps, out_burst);
+
+		send_info("sink=%u chunk=0x%zx", g_sink_rate, g_tuner.size);
+		send_info("pairs=%d stripe=%d", g_pairs, g_stripe);
+		send_info("io=%s", g_ring ? "uring" : "sync");
+
+		fm.key = OKAY;
+		send_data(&fm, 4);
+
+	} else if (strncmp(cmd, "Resume:", 7) == 0) {
+		/* Resume:<target>, OKAY with the hex end of the verified data */
+		uint64_t end;
+		int err = -EINVAL;
+
+		if (g_journal.dir)
+			err = journal_verify(cmd + 7, &end);
+		if (err) {
+			printf("Resume: %s\n", strerror(-err));
+			fm.key = FAIL;
+			send_data(&fm, 4);
+		} else {
+			printf("Resume: %s from 0x%llx\n", cmd + 7, (unsigned long long)end);
+			fm.key = OKAY;
+			sprintf(fm.data, "%llx", (unsigned long long)end);
+			send_data(&fm, 4 + strlen(fm.data));
+		}
+
+	} else if (strncmp(cmd, "Seek:", 5) == 0) {
+		/* Seek:<hex offset>, where the next donwload: without one goes */
+		off_t pos = strtoull(cmd + 5, NULL, 16);
+
+		fm.key = FAIL;
+		if (g_open_file >= 0 && g_open_file != g_stdin) {
+			if (g_pipe.enabled)
+				pipe_drain();
+			if (lseek(g_open_file, pos, SEEK_SET) == pos) {
+				g_journal.pos = pos;
+				fm.key = OKAY;
+			}
+		}
+		send_data(&fm, 4);
+
+	} else if (strncmp(cmd, "Manifest:", 9) == 0) {
+		/* Manifest:<hex size>, the text comes like a donwload: */
+		uint32_t size = strtoul(cmd + 9, NULL, 16);
+		char *text = malloc(round_up_to_cache_line(size + 1));
+		ssize_t rs;
+		int i, err;
+
+		if (!text) {
+			fm.key = FAIL;
+			send_data(&fm, 4);
+			return -1;
+		}
+		/* what is left of one not finished */
+		if (g_manifest.count)
+			manifest_end();
+
+		fm.key = DATA;
+		sprintf(fm.data, "%08X", size);
+		send_data(&fm, 4 + strlen(fm.data));
+		rs = recv_msg(text, round_up_to_cache_line(size + 1));
+
+		memset(&fm, 0, sizeof(fm));
+		err = -EIO;
+		if (rs == size) {
+			text[size] = '\0';
+			memset(&g_manifest, 0, sizeof(g_manifest));
+			err = manifest_parse(text);
+		}
+		if (err) {
+			printf("Manifest: %s\n", strerror(-err));
+			g_manifest.count = 0;
+			fm.key = FAIL;
+			send_data(&fm, 4);
+		} else {
+			manifest_plan();
+			for (i = 0; i < g_manifest.count; i++) {
+				printf("%d: %s on %s\n", g_manifest.order[i],
+				       g_manifest.part[g_manifest.order[i]].target,
+				       g_manifest.part[g_manifest.order[i]].dev);
+				send_info("send %d", g_manifest.order[i]);
+			}
+			manifest_skip();
+			g_manifest.start_us = now_us();
+			fm.key = OKAY;
+			sprintf(fm.data, "%d", g_manifest.count);
+			send_data(&fm, 4 + strlen(fm.data));
+		}
+		free(text);
+
+	} else if (strcmp(cmd, "Done") == 0) {
+		/* the end of a manifest, INFO "<n> <name> <ms> <rate> <result>" each */
+		if (!g_manifest.count)
+			fm.key = FAIL;
+		else
+			fm.key = manifest_end() ? FAIL : OKAY;
+		send_data(&fm, 4);
+
+	} else if (strncmp(cmd, "CacheHas:", 9) == 0) {
+		/* CacheHas:<sha256>, INFO with the size if it is there */
+		char path[512];
+		struct stat st;
+
+		fm.key = FAIL;
+		if (g_cache.dir && !cache_path(path, sizeof(path), cmd + 9) &&
+		    !stat(path, &st)) {
+			send_info("size=0x%llx", (unsigned long long)st.st_size);
+			fm.key = OKAY;
+		}
+		send_data(&fm, 4);
+
+	} else if (strncmp(cmd, "CacheWrite:", 11) == 0) {
+		/* CacheWrite:<sha256>, to the open target like a donwload: */
+		ssize_t n = -EBADF;
+
+		if (g_cache.dir && g_open_file >= 0)
+			n = cache_write(cmd + 11, g_open_file);
+		/* the blob being collected no longer matches the target */
+		cache_abandon();
+		if (n >= 0) {
+			send_info("wrote=0x%zx", n);
+			fm.key = OKAY;
+		} else {
+			printf("CacheWrite failed: %s\n", strerror(-n));
+			fm.key = FAIL;
+		}
+		send_data(&fm, 4);
+
+	} else if (strncmp(cmd, "Stripe:", 7) == 0) {
+		/*
+		 * Stripe:<pairs>
+		 * carry download and upload data over that many data pairs,
+		 * 0 goes back to ep1/ep2
+		 */
+		int n = strtol(cmd + 7, NULL, 0);
+
+		if (g_tcp || n < 0 || n > g_pairs) {
+			fm.key = FAIL;
+		} else {
+			g_stripe = n;
+			fm.key = OKAY;
+		}
+		send_data(&fm, 4);
+
+	} else if (strncmp(cmd, "Loopback:", 9) == 0) {
+		/*
+		 * Loopback:<hex size>
+		 * take the data like donwload: does, send it straight back on
+		 * the IN endpoint, then report the device side rate in kB/s
+		 */
+		uint32_t size;
+		uint64_t start;
+		ssize_t rs;
+
+		size = strtoul(cmd + 9, NULL, 16);
+		void *p = malloc(round_up_to_cache_line(size));
+		if (!p) {
+			fm.key = FAIL;
+			send_data(&fm, 4);
+			return -1;
+		}
+
+		fm.key = DATA;
+		sprintf(fm.data, "%08X", size);
+		send_data(&fm, 4 + strlen(fm.data));
+
+		start = now_us();
+		rs = recv_msg(p, round_up_to_cache_line(size));
+		if (rs == size)
+			send_data(p, size);
+
+		memset(&fm, 0, sizeof(fm));
+		if (rs == size) {
+			send_info("usb=%u", kb_per_sec(2 * (uint64_t)size, now_us() - start));
+			fm.key = OKAY;
+		} else {
+			printf("read size %zd != %d\n", rs, size);
+			fm.key = FAIL;
+		}
+		send_data(&fm, 4);
+		free(p);
+
 	} else {
 		printf("Unknow Cmd %s\n", cmd);
 	}
@@ -615,10 +3083,25 @@ int handle_cmd(const char *cmd)
 void init_usb_fs()
 {
 	ssize_t ret;
+	size_t len = sizeof(g_descriptors);
+	const void *desc = &g_descriptors;
+	void *buf = NULL;
+	char *ready;
 
 	printf("Start init usb\n");
 
-	ret = write(g_ep_0, &g_descriptors, sizeof(g_descriptors));
+	if (g_pairs || g_burst > 1) {
+		buf = build_descriptors(g_pairs, g_burst, &len);
+		if (!buf) {
+			printf("build descriptor failure\n");
+			exit(1);
+		}
+		desc = buf;
+		printf("%d data pairs, burst %d\n", g_pairs, g_burst);
+	}
+
+	ret = write(g_ep_0, desc, len);
+	free(buf);
 	if (ret < 0) {
 		printf("write descriptor failure\n");
 		exit(1);
@@ -630,20 +3113,249 @@ void init_usb_fs()
 		printf("write string failure\n");
 		exit(1);
 	}
+
+	/* the endpoints exist now, tell gadgetd to bind the UDC */
+	ready = getenv("UFB_READY_FD");
+	if (ready) {
+		if (write(atoi(ready), "", 1) != 1)
+			printf("can't signal ready: %s\n", strerror(errno));
+		close(atoi(ready));
+		unsetenv("UFB_READY_FD");
+	}
 }
 
 
+static void *tcp_session(void *arg)
+{
+	char buff[512];
+	int r, positioned;
+
+	g_ep_sink = g_ep_source = (intptr_t)arg;
+
+	while (1) {
+		memset(buff, 0, sizeof(buff));
+		r = recv_msg(buff, sizeof(buff) - 1);
+		if (r <= 0)
+			break;
+
+		positioned = strncmp(buff, "donwload:", 9) == 0 && strchr(buff, '@');
+		if (positioned)
+			pthread_rwlock_rdlock(&g_cmd_lock);
+		else
+			pthread_rwlock_wrlock(&g_cmd_lock);
+		r = handle_cmd(buff);
+		pthread_rwlock_unlock(&g_cmd_lock);
+
+		/* the stream may be out of sync */
+		if (r < 0)
+			break;
+	}
+
+	close(g_ep_source);
+	return NULL;
+}
+
+/* an explicit address: IPv4, IPv6 in brackets, fe80::1%usb0 for a scope */
+static int tcp_bind_addr(const char *host, const char *port)
+{
+	struct addrinfo hints = {
+		.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV,
+		.ai_socktype = SOCK_STREAM,
+	}, *res;
+	int fd, on = 1;
+
+	if (getaddrinfo(host, port, &hints, &res)) {
+		errno = EINVAL;
+		return -1;
+	}
+	fd = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd >= 0) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, res->ai_addr, res->ai_addrlen)) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+/* every address, or every address of one interface */
+static int tcp_bind_any(int port, const char *dev)
+{
+	struct sockaddr_in6 addr6 = {
+		.sin6_family = AF_INET6,
+		.sin6_port = htons(port),
+		.sin6_addr = IN6ADDR_ANY_INIT,
+	};
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	int fd, on = 1, off = 0;
+
+	/* IPv6 also takes IPv4 connections, NCM links often only have the former */
+	fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd >= 0) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+		if ((dev && setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, dev, strlen(dev))) ||
+		    bind(fd, (struct sockaddr *)&addr6, sizeof(addr6))) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd < 0) {
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if ((dev && setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, dev, strlen(dev))) ||
+		    bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/* "<port>", "<addr>:<port>", "[<addr6>]:<port>" or "%<interface>:<port>" */
+static int tcp_serve(const char *spec)
+{
+	char host[128];
+	const char *port = strrchr(spec, ':');
+	pthread_attr_t attr;
+	pthread_t thread;
+	int fd, conn, on = 1;
+
+	if (!port) {
+		port = spec;
+		host[0] = 0;
+	} else {
+		snprintf(host, sizeof(host), "%.*s", (int)(port - spec), spec);
+		port++;
+	}
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		memmove(host, host + 1, strlen(host));
+		host[strlen(host) - 1] = 0;
+	}
+
+	if (!host[0]) {
+		printf("listening on all interfaces, keep the port off other networks\n");
+		fd = tcp_bind_any(atoi(port), NULL);
+	} else if (host[0] == '%') {
+		fd = tcp_bind_any(atoi(port), host + 1);
+	} else {
+		fd = tcp_bind_addr(host, port);
+	}
+	if (fd < 0)
+		return -1;
+	if (listen(fd, 8)) {
+		close(fd);
+		return -1;
+	}
+
+	g_tcp = 1;
+	printf("Start handle command on tcp %s\n", spec);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (1) {
+		conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		if (pthread_create(&thread, &attr, tcp_session, (void *)(intptr_t)conn))
+			close(conn);
+	}
+
+	close(fd);
+	return -1;
+}
+
 int main(int argc, char **argv)
 {
 	printf("%s %s [built %s %s]\n", PACKAGE, VERSION, __DATE__, __TIME__);
 
 	char file[] = "/dev/usb-ffs/ep0";
 	char *usb_file = file;
+	char ep[256];
+	int opt, i;
 
 	signal(SIGPIPE, SIG_IGN);
 
-	if (argc > 1)
-		usb_file = argv[1];
+	while ((opt = getopt(argc, argv, "n:b:Pc:FC:DW:OSJ:")) != -1) {
+		switch (opt) {
+		case 'C':
+			g_cache.dir = optarg;
+			if (mkdir(optarg, 0700) && errno != EEXIST) {
+				printf("can't create %s: %s\n", optarg, strerror(errno));
+				exit(1);
+			}
+			break;
+		case 'D':
+			g_prediscard = 1;
+			break;
+		case 'W':
+			g_wb_every = strtoull(optarg, NULL, 0) << 20;
+			break;
+		case 'O':
+			g_direct = 1;
+			break;
+		case 'S':
+			g_sync_io = 1;
+			break;
+		case 'J':
+			g_journal.dir = optarg;
+			break;
+		case 'P':
+			g_pipe.enabled = 1;
+			break;
+		case 'c':
+			/* cpus of the rx, hash and write stages */
+			sscanf(optarg, "%d,%d,%d", &g_pipe.stage[STAGE_RX].cpu,
+			       &g_pipe.stage[STAGE_HASH].cpu, &g_pipe.stage[STAGE_WRITE].cpu);
+			break;
+		case 'F':
+			g_pipe.fifo = 1;
+			break;
+		case 'n':
+			g_pairs = atoi(optarg);
+			break;
+		case 'b':
+			g_burst = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s [-n <data pairs>] [-b <burst>] [-P [-c <rx>,<hash>,<write>] [-F]]\n"
+			       "	[-C <cache dir>] [-D] [-W <writeback MB>] [-O] [-S] [-J <journal dir>]\n"
+			       "	[<ep0>|tcp:[<addr>:]<port>]\n",
+			       argv[0]);
+			exit(1);
+		}
+	}
+	if (g_pairs < 0 || g_pairs > MAX_DATA_PAIRS || g_burst < 1 || g_burst > 16) {
+		printf("up to %d data pairs and bursts of 1 to 16 packets\n", MAX_DATA_PAIRS);
+		exit(1);
+	}
+
+	if (optind < argc)
+		usb_file = argv[optind];
+
+	if (!g_sync_io)
+		g_ring = uring_open();
+
+	if (strncmp(usb_file, "tcp:", 4) == 0) {
+		/* splice already keeps the data off the command threads */
+		g_pipe.enabled = 0;
+		tuner_init(&g_tuner, 0x10000, max_buffer_size(MAX_XFER_SIZE), 1 << 20);
+		tcp_serve(usb_file + 4);
+		printf("can't serve tcp %s: %s\n", usb_file + 4, strerror(errno));
+		exit(1);
+	}
 
 	g_ep_0 = open(usb_file, O_RDWR);
 	if (g_ep_0 < 0) {
@@ -652,6 +3364,8 @@ int main(int argc, char **argv)
 	}
 	init_usb_fs();
 
+	tuner_init(&g_tuner, 0x10000, max_buffer_size(MAX_XFER_SIZE), 1 << 20);
+
 	usb_file[strlen(usb_file) - 1] = '1';
 	g_ep_sink = open(usb_file, O_RDWR);
 	if (g_ep_sink < 0) {
@@ -666,6 +3380,23 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	/* epN files follow the descriptor order, ep0 ends the given path */
+	for (i = 0; i < g_pairs; i++) {
+		snprintf(ep, sizeof(ep), "%.*s%d", (int)strlen(usb_file) - 1, usb_file, 3 + 2 * i);
+		g_data_in[i] = open(ep, O_RDWR);
+		snprintf(ep, sizeof(ep), "%.*s%d", (int)strlen(usb_file) - 1, usb_file, 4 + 2 * i);
+		g_data_out[i] = open(ep, O_RDWR);
+		if (g_data_in[i] < 0 || g_data_out[i] < 0) {
+			printf("can't open data pair %d\n", i);
+			exit(1);
+		}
+	}
+
+	if (g_pipe.enabled && pipe_start()) {
+		printf("can't start the pipeline\n");
+		exit(1);
+	}
+
 	printf("Start handle command\n");
 	while (1) {
 		int r;
@@ -29,13 +29,16 @@
 #include <sys/types.h>
 #include <sys/sysmacros.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <string.h>
+#include <libgen.h>
 #include <malloc.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include <pthread.h>
+#include <time.h>
 #include <linux/reboot.h>
 #include <sys/reboot.h>
 #include <sys/sysmacros.h>
@@ -45,8 +48,13 @@
  */
 #include <linux/watchdog.h>
 
+#include "storage.h"
+
 #define UTP_TARGET_FILE	"/tmp/file.utp"
 
+/* largest payload carried by a single utp_message in either direction */
+#define UTP_BUFSIZE	0x10000
+
 #define UTP_FLAG_COMMAND	0x00000001
 #define UTP_FLAG_DATA		0x00000002
 #define UTP_FLAG_STATUS		0x00000004    //indicate an error happens
@@ -89,6 +97,42 @@ struct utp_message {
 
 static int utp_file = -1;
 
+/* throughput of the data messages written to utp_file */
+static struct xfer_tuner utp_sink;
+
+/* zero runs of a 'send' to a block device, and bytes so elided overall */
+static struct blk_sink utp_blk = { .fd = -1 };
+static uint64_t utp_elided;
+
+/* writeback policy of 'send' targets, set by 'writeback' */
+static uint64_t utp_wb_every;
+static int utp_direct;
+
+/* first failed write of the data messages, they have no answer of their own */
+static int utp_write_err;
+
+/*
+ * write what the sink still holds, before utp_file goes away; the error
+ * of that or of an earlier write of the data
+ */
+static int utp_blk_close(void)
+{
+	int ret = blk_sink_close(&utp_blk);
+
+	if (utp_blk.elided)
+		printf("UTP: %llu zero bytes left to the device\n",
+		       (unsigned long long)utp_blk.elided);
+	utp_elided += utp_blk.elided;
+	blk_sink_init(&utp_blk, -1);
+	if (utp_write_err)
+		ret = utp_write_err;
+	utp_write_err = 0;
+	return ret;
+}
+
+/* optional protocol features, reported by 'caps' */
+static const char *utp_features = "async,stream-read,direct-send,selftest,caps,zero-elide,erase,writeback";
+
 static inline char *utp_answer_type(struct utp_message *u)
 {
 	if (!u)
@@ -163,13 +207,41 @@ static int utp_run(char *command, ... )
  *
  * report the busy state to the kernel state machine
  */
+static pthread_mutex_t utp_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void utp_send_busy(int u)
 {
 	struct utp_message w;
 
 	w.flags = UTP_FLAG_REPORT_BUSY;
 	w.size = sizeof(w);
+	pthread_mutex_lock(&utp_write_lock);
 	write(u, &w, w.size);
+	pthread_mutex_unlock(&utp_write_lock);
+}
+
+/*
+ * utp_write_answer
+ *
+ * deliver a message to the kernel state machine, the main loop and the
+ * executor thread both write to the device
+ */
+static void utp_write_answer(int u, struct utp_message *answer)
+{
+	pthread_mutex_lock(&utp_write_lock);
+	write(u, answer, answer->size);
+	pthread_mutex_unlock(&utp_write_lock);
+}
+
+/*
+ * utp_send_answer
+ *
+ * deliver the answer for a command, logged
+ */
+static void utp_send_answer(int u, struct utp_message *answer, char *command)
+{
+	printf("UTP: sending %s to kernel for command %s.\n", utp_answer_type(answer), command);
+	utp_write_answer(u, answer);
 }
 
 /*
@@ -215,34 +287,402 @@ static int utp_partition_mmc(char *disk)
 /*
  * utp_do_selftest
  *
- * perform some diagnostics
+ * benchmark memory and the storage devices so the host can choose chunk
+ * sizes, compression and parallelism for this board:
  *
- * TBW
+ *	selftest [<kB per device> [rw]]
+ *
+ * The result is XML, sequential rates are kB/s, random rates are 4 kB
+ * operations per second, 0 where not measured. Devices are only read
+ * unless 'rw' is given, writes then put back the data just read.
  */
-static int utp_do_selftest(void)
+static char *utp_do_selftest(char *args, size_t *size)
 {
-	return 0;
+	struct bench_result res;
+	struct bench_target *t;
+	unsigned long kb = 0;
+	char *data, rw[8] = "";
+	int i, len;
+
+	if (args)
+		sscanf(args, "%lu %7s", &kb, rw);
+	storage_selftest(&res, kb * 1024, strcmp(rw, "rw") == 0);
+
+	data = malloc(256 + 192 * res.count);
+	if (!data)
+		return NULL;
+
+	len = sprintf(data,
+		"<SELFTEST>\n"
+		" <MEM memcpy=\"%u\" crc32=\"%u\"/>\n",
+		res.memcpy_rate, res.crc32_rate);
+	for (i = 0; i < res.count; i++) {
+		t = &res.target[i];
+		len += sprintf(data + len,
+			" <DEV name=\"%s\" type=\"%s\" size=\"%llu\" seqrd=\"%u\""
+			" seqwr=\"%u\" rndrd=\"%u\" rndwr=\"%u\"/>\n",
+			t->name, t->type, (unsigned long long)t->size,
+			t->seq_read, t->seq_write, t->rand_read, t->rand_write);
+	}
+	len += sprintf(data + len, "</SELFTEST>\n");
+
+	*size = len + 1;
+	return data;
 }
+
 /*
  * Put the command which needs to send busy first
  * And the host will send poll for getting its return value
  * later, we call these kinds of commands as Asynchronous Commands.
+ *
+ * Asynchronous commands run on the executor thread, so the main loop
+ * keeps servicing the UTP device while they are in progress. The host
+ * may mark any other command asynchronous by prefixing it with '&'.
+ * Immediate commands don't touch any state and are answered by the main
+ * loop at once, even while the executor is busy.
  */
-static int utp_can_busy(char *command)
+#define UTP_CMD_ASYNC		0x1
+#define UTP_CMD_IMMEDIATE	0x2
+
+static const struct {
+	char *prefix;
+	int flags;
+} utp_cmd_attrs[] = {
+	{ "$ ",		UTP_CMD_ASYNC },
+	{ "frf",	UTP_CMD_ASYNC },
+	{ "pollpipe",	UTP_CMD_ASYNC },
+	{ "selftest",	UTP_CMD_ASYNC },
+	{ "erase",	UTP_CMD_ASYNC },
+	{ "?",		UTP_CMD_IMMEDIATE },
+	{ "jobs",	UTP_CMD_IMMEDIATE },
+	{ "caps",	UTP_CMD_IMMEDIATE },
+	{ NULL,		0 },
+};
+
+static int utp_cmd_flags(char *command)
 {
-	char *async[] ={
-		"$ ", "frf", "pollpipe", NULL,
-	};
-	char **ptr;
+	int i;
 
-	ptr = async;
-	while (*ptr) {
-		if (strncmp(command, *ptr, strlen(*ptr)) == 0)
-			return 1;
-		ptr++;
+	for (i = 0; utp_cmd_attrs[i].prefix; i++) {
+		if (strncmp(command, utp_cmd_attrs[i].prefix,
+			    strlen(utp_cmd_attrs[i].prefix)) == 0)
+			return utp_cmd_attrs[i].flags;
 	}
 	return 0;
 }
+
+/* commands waiting for or running on the executor thread */
+struct utp_job {
+	struct utp_job *next;
+	unsigned long long payload;
+	char command[];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t idle;
+	struct utp_job *head, *tail;
+	struct utp_job *current;
+	time_t started;
+	uint64_t done, total;	/* progress of the running command */
+	int pending;		/* queued plus running */
+} utp_exec = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+};
+
+static void utp_erase_progress(void *arg, uint64_t done, uint64_t total)
+{
+	pthread_mutex_lock(&utp_exec.lock);
+	utp_exec.done = done;
+	utp_exec.total = total;
+	pthread_mutex_unlock(&utp_exec.lock);
+}
+
+/*
+ * utp_erase
+ *
+ * wipe a device or a range of it with the cheapest primitive it has:
+ *
+ *	erase <dev>[,<offset>,<length>][,zero|discard|secure]
+ *
+ * The whole device by default, discarded unless zeros are asked for.
+ * 'jobs' shows the progress.
+ */
+static int utp_erase(char *args)
+{
+	char arg[256], *dev, *tok, *save;
+	unsigned long long v[2] = { 0, 0 };
+	const char *method;
+	int mode = ERASE_DISCARD, n = 0, fd, ret;
+	uint64_t start;
+
+	snprintf(arg, sizeof(arg), "%s", args + strspn(args, " \t"));
+	dev = strtok_r(arg, ",", &save);
+	while ((tok = strtok_r(NULL, ",", &save))) {
+		if (strcmp(tok, "zero") == 0)
+			mode = ERASE_ZERO;
+		else if (strcmp(tok, "discard") == 0)
+			mode = ERASE_DISCARD;
+		else if (strcmp(tok, "secure") == 0)
+			mode = ERASE_SECURE;
+		else if (n < 2)
+			v[n++] = strtoull(tok, NULL, 0);
+	}
+
+	if (!dev)
+		return -EINVAL;
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		ret = -errno;
+		printf("UTP: can't open %s: %s\n", dev, strerror(-ret));
+		return ret;
+	}
+	start = now_us();
+	ret = storage_erase(fd, v[0], v[1], mode, utp_erase_progress, NULL, &method);
+	close(fd);
+	if (ret)
+		printf("UTP: erasing %s by %s failed: %s\n", dev, method, strerror(-ret));
+	else
+		printf("UTP: erased %s by %s in %llu ms\n", dev, method,
+		       (unsigned long long)(now_us() - start) / 1000);
+	return ret;
+}
+
+/*
+ * utp_read_full
+ *
+ * read until the buffer is full or the end of file is reached
+ */
+static ssize_t utp_read_full(int f, uint8_t *buf, size_t size)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < size) {
+		r = read(f, buf + done, size - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -errno;
+		if (r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+/*
+ * utp_stream_read
+ *
+ * send the file as a series of data messages of at most UTP_BUFSIZE
+ * bytes. The data is read straight into the message, and the two
+ * messages are reused for the whole file, so memory use doesn't depend
+ * on the file size. The last chunk is returned as the answer for the
+ * command, it's found by reading one chunk ahead since the size of
+ * files in /proc or /sys can't be known in advance.
+ */
+static struct utp_message *utp_stream_read(int u, int f, uint32_t *status)
+{
+	struct utp_message *cur, *next, *tmp;
+	ssize_t len, next_len;
+
+	cur = malloc(sizeof(*cur) + UTP_BUFSIZE);
+	next = malloc(sizeof(*next) + UTP_BUFSIZE);
+	if (!cur || !next) {
+		*status = -ENOMEM;
+		goto fail;
+	}
+
+	posix_fadvise(f, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	len = utp_read_full(f, cur->data, UTP_BUFSIZE);
+	while (len == UTP_BUFSIZE) {
+		next_len = utp_read_full(f, next->data, UTP_BUFSIZE);
+		if (next_len <= 0) {
+			len = next_len < 0 ? next_len : len;
+			break;
+		}
+
+		cur->flags = UTP_FLAG_DATA;
+		cur->size = sizeof(*cur) + len;
+		cur->bufsize = len;
+		/* not logged, the last chunk is as the answer of the command */
+		utp_write_answer(u, cur);
+
+		tmp = cur;
+		cur = next;
+		next = tmp;
+		len = next_len;
+	}
+
+	if (len < 0) {
+		*status = len;
+		goto fail;
+	}
+
+	free(next);
+	cur->flags = UTP_FLAG_DATA;
+	cur->size = sizeof(*cur) + len;
+	cur->bufsize = len;
+	return cur;
+
+fail:
+	free(cur);
+	free(next);
+	return NULL;
+}
+
+/*
+ * 'send' without a destination fills UTP_TARGET_FILE as it always did.
+ * With one, it writes into a temporary file next to the destination, or
+ * straight into the destination for device nodes, and 'save' renames the
+ * staged file into place. utp_send_src is empty when nothing is staged.
+ */
+static char utp_send_src[256];
+static char utp_send_dest[256];
+
+/*
+ * utp_send_open
+ *
+ * open the target for 'send'. Files are preallocated to the announced
+ * size on the destination's filesystem, so the data never sits in tmpfs
+ * and is written exactly once. Returns the fd or -errno.
+ */
+static int utp_send_open(char *dest, unsigned long long size)
+{
+	char dir[256];
+	struct stat st;
+	int f, err;
+
+	utp_send_src[0] = '\0';
+	snprintf(utp_send_dest, sizeof(utp_send_dest), "%s", dest ? dest : "");
+
+	if (!dest) {
+		f = open(UTP_TARGET_FILE, O_TRUNC | O_CREAT | O_WRONLY, 0666);
+		if (f >= 0)
+			strcpy(utp_send_src, UTP_TARGET_FILE);
+	} else if (stat(dest, &st) == 0 && (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode))) {
+		printf("UTP: sending directly to %s\n", dest);
+		f = open(dest, O_WRONLY);
+		if (f < 0) {
+			err = -errno;
+			printf("UTP: can't open %s: %s\n", dest, strerror(-err));
+			return err;
+		}
+		return f;
+	} else {
+		snprintf(dir, sizeof(dir), "%s", dest);
+		snprintf(utp_send_src, sizeof(utp_send_src), "%s/.utp-XXXXXX", dirname(dir));
+		f = mkstemp(utp_send_src);
+		if (f >= 0)
+			fchmod(f, 0666);
+		else
+			utp_send_src[0] = '\0';
+	}
+
+	if (f < 0) {
+		err = -errno;
+		printf("UTP: can't create file for %s: %s\n",
+				dest ? dest : UTP_TARGET_FILE, strerror(-err));
+		return err;
+	}
+
+	/* blocks are reserved, the size still follows what is written */
+	if (size && fallocate(f, FALLOC_FL_KEEP_SIZE, 0, size) < 0)
+		printf("UTP: can't preallocate %llu bytes: %s\n", size, strerror(errno));
+
+	printf("UTP: sending to %s\n", utp_send_src);
+	return f;
+}
+
+/*
+ * utp_copy_file
+ *
+ * copy src to dst in the kernel, for a 'save' across filesystems
+ */
+static int utp_copy_file(char *src, char *dst)
+{
+	struct stat st;
+	ssize_t r;
+	int in, out, ret = 0;
+
+	in = open(src, O_RDONLY);
+	if (in < 0)
+		return -errno;
+	out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) {
+		ret = -errno;
+		close(in);
+		return ret;
+	}
+
+	fstat(in, &st);
+	while (st.st_size > 0) {
+		r = sendfile(out, in, NULL, st.st_size);
+		if (r <= 0) {
+			ret = r < 0 ? -errno : -EIO;
+			break;
+		}
+		st.st_size -= r;
+	}
+
+	if (!ret && fsync(out) < 0)
+		ret = -errno;
+	close(out);
+	close(in);
+	return ret;
+}
+
+/*
+ * utp_save
+ *
+ * finish a 'send': flush the data and atomically rename the staged file
+ * over the destination, copying only when it lives on another filesystem
+ */
+static int utp_save(char *dest)
+{
+	int ret;
+
+	ret = utp_blk_close();
+	if (utp_file >= 0) {
+		/* drop the preallocation beyond what was actually sent */
+		if (utp_send_src[0])
+			ftruncate(utp_file, lseek(utp_file, 0, SEEK_CUR));
+		if (fsync(utp_file) < 0 && errno != EINVAL)
+			ret = -errno;
+		close(utp_file);
+		utp_file = -1;
+	}
+
+	if (!dest || !*dest)
+		dest = utp_send_dest;
+
+	/* written in place, nothing to move */
+	if (!utp_send_src[0] || !*dest)
+		return ret;
+
+	if (!ret && rename(utp_send_src, dest) < 0) {
+		ret = -errno;
+		if (errno == EXDEV) {
+			ret = utp_copy_file(utp_send_src, dest);
+			if (!ret)
+				unlink(utp_send_src);
+		}
+	}
+	if (ret) {
+		printf("UTP: can't save %s to %s: %s\n", utp_send_src, dest, strerror(-ret));
+		/* don't leave a stale temporary file on the destination */
+		if (utp_send_dest[0])
+			unlink(utp_send_src);
+	}
+
+	utp_send_src[0] = '\0';
+	return ret;
+}
+
 #ifdef NEED_TO_GET_CHILD_PID
 /* for pipe */
 #define READ 0
@@ -251,8 +691,9 @@ static pid_t child_pid = -1;
 static int utp_flush(void)
 {
 	int pstat;
-	int ret = 0;
+	int ret = 0, err;
 	pid_t pid;
+	err = utp_blk_close();
 	if (utp_file >= 0) {
 		fflush(NULL);
 		ret = close(utp_file);
@@ -262,7 +703,7 @@ static int utp_flush(void)
 		printf("UTP: closing the file\n");
 	}
 	utp_file = -1;
-	return ret;
+	return err ? err : ret;
 }
 pid_t popen2(const char *command, int *infp, int *outfp)
 {
@@ -382,7 +823,8 @@ int utp_poll_pipe()
 #else
 static int utp_flush(void)
 {
-	int ret;
+	int ret = 0, err;
+	err = utp_blk_close();
 	if (utp_file_f) {
 		printf("UTP: waiting for pipe to close\n");
 		ret = pclose(utp_file_f);
@@ -394,7 +836,7 @@ static int utp_flush(void)
 	utp_file_f = NULL;
 	utp_file = -1;
 	printf("UTP: files were flushed.\n");
-	return ret;
+	return err ? err : ret;
 }
 static int utp_pipe(char *command, ... )
 {
@@ -423,9 +865,16 @@ static int utp_pipe(char *command, ... )
  *	wfs/wff <X>		write firmware to SD/flash
  *	wrs/wrf <X>		write rootfs to SD/flash
  *	frs/frf <X>		format partition for root on SD/flash
- *	erase <X>		erase partition on flash
- *	read			not implemented yet
+ *	erase <dev>[,off,len][,zero|discard|secure]
+ *				erase a range, the whole device by default
+ *	read <file>		stream the file back to the host
+ *	send [<file>]		receive data for <file>, UTP_TARGET_FILE if none
+ *	save [<file>]		commit the data received by 'send'
+ *	selftest [<kB> [rw]]	benchmark memory and storage
  *	write			not implemented yet
+ *	jobs			report the asynchronous command in progress
+ *	caps			report features, buffer sizes and sink rate
+ *	&<command>		run any command asynchronously
  */
 static struct utp_message *utp_handle_command(int u, char *cmd, unsigned long long payload)
 {
@@ -444,11 +893,6 @@ static struct utp_message *utp_handle_command(int u, char *cmd, unsigned long lo
 	flags = 0;
 	size = 0;
 
-	/* these are asynchronous commands and need to send busy */
-	if (utp_can_busy(cmd)){
-		utp_send_busy(u);
-	}
-
 	if (strcmp(cmd, "?") == 0) {
 		/* query */
 		flags = UTP_FLAG_DATA;
@@ -465,6 +909,44 @@ static struct utp_message *utp_handle_command(int u, char *cmd, unsigned long lo
 		size = (strlen(data) + 1 ) * sizeof(data[0]);
 	}
 
+	else if (strcmp(cmd, "jobs") == 0) {
+		/* report what the executor is doing */
+		flags = UTP_FLAG_DATA;
+		data = malloc(1024);
+		pthread_mutex_lock(&utp_exec.lock);
+		snprintf(data, 1024,
+			"<JOBS>\n"
+			" <RUNNING>%s</RUNNING>\n"
+			" <ELAPSED>%ld</ELAPSED>\n"
+			" <PROGRESS>%llu/%llu</PROGRESS>\n"
+			" <PENDING>%d</PENDING>\n"
+			" <DURABLE>%llu</DURABLE>\n"
+			"</JOBS>\n",
+			utp_exec.current ? utp_exec.current->command : "",
+			utp_exec.current ? (long)(time(NULL) - utp_exec.started) : 0L,
+			(unsigned long long)utp_exec.done, (unsigned long long)utp_exec.total,
+			utp_exec.pending, (unsigned long long)utp_blk.durable);
+		pthread_mutex_unlock(&utp_exec.lock);
+		size = (strlen(data) + 1 ) * sizeof(data[0]);
+	}
+
+	else if (strcmp(cmd, "caps") == 0) {
+		/* features, buffer size and sink rate for the host to tune transfers */
+		flags = UTP_FLAG_DATA;
+		data = malloc(512);
+		sprintf(data,
+			"<CAPS>\n"
+			" <FEATURES>%s</FEATURES>\n"
+			" <MAXBUF>%zu</MAXBUF>\n"
+			" <CHUNK>%d</CHUNK>\n"
+			" <SINK>%u</SINK>\n"
+			" <ELIDED>%llu</ELIDED>\n"
+			"</CAPS>\n",
+			utp_features, max_buffer_size(SIZE_MAX), UTP_BUFSIZE, utp_sink.rate,
+			(unsigned long long)(utp_elided + utp_blk.elided));
+		size = (strlen(data) + 1 ) * sizeof(data[0]);
+	}
+
 	else if (cmd[0] == '!') {
 		/* reboot the system, and the ACK has already sent out */
 		if (cmd[1] == '3') {
@@ -509,7 +991,7 @@ static struct utp_message *utp_handle_command(int u, char *cmd, unsigned long lo
 
 		/* write data to the first partition */
 		if (!status && utp_mk_devnode("block", "mmcblk0/mmcblk0p1", "/dev/mmc0p1", S_IFBLK) >= 0) {
-			utp_run("dd if=/dev/zero of=/dev/mmc0p1 bs=512 count=4");
+			utp_erase("/dev/mmc0p1,0,2048,zero");
 			utp_run("dd if=%s of=/dev/mmc0p1 ibs=512 seek=4 conv=sync,notrunc", UTP_TARGET_FILE);
 		}
 
@@ -608,36 +1090,58 @@ static struct utp_message *utp_handle_command(int u, char *cmd, unsigned long lo
 			flags = UTP_FLAG_STATUS;
 			status = errno;
 		} else {
-			size = lseek(f, 0, SEEK_END);	/* get the file size */
-			lseek(f, 0, SEEK_SET);
-
-			data = malloc(size);
-			if (!data) {
-				flags = UTP_FLAG_STATUS;
-				status = -ENOMEM;
-			} else {
-				read(f, data, size);
-				flags = UTP_FLAG_DATA;
-			}
+			w = utp_stream_read(u, f, &status);
+			close(f);
+			if (w)
+				return w;
+			flags = UTP_FLAG_STATUS;
 		}
 	}
 
-	else if (strcmp(cmd, "send") == 0) {
-		utp_file = open(UTP_TARGET_FILE, O_TRUNC | O_CREAT | O_WRONLY, 0666);
+	else if (strcmp(cmd, "send") == 0 || strncmp(cmd, "send ", 5) == 0) {
+		utp_file = utp_send_open(cmd[4] ? cmd + 5 : NULL, payload);
+		utp_write_err = 0;
+		if (utp_file < 0) {
+			flags = UTP_FLAG_STATUS;
+			status = utp_file;
+			utp_file = -1;
+		}
+		blk_sink_init(&utp_blk, utp_file);
+		blk_sink_policy(&utp_blk, utp_wb_every, utp_direct);
 	}
 
-	else if (strncmp(cmd, "save", 4) == 0) {
-		close(utp_file);
-		rename(UTP_TARGET_FILE, cmd + 5);
+	else if (strcmp(cmd, "save") == 0 || strncmp(cmd, "save ", 5) == 0) {
+		status = utp_save(cmd[4] ? cmd + 5 : NULL);
+		if (status)
+			flags = UTP_FLAG_STATUS;
 	}
 
 
-	else if (strcmp(cmd, "selftest") == 0) {
-		status = utp_do_selftest();
+	else if (strncmp(cmd, "writeback", 9) == 0) {
+		/*
+		 * writeback <MB>[,direct]: the policy of the following sends,
+		 * 'jobs' then shows the bytes known to be on the media
+		 */
+		utp_wb_every = strtoull(cmd + 9, NULL, 0) << 20;
+		utp_direct = strstr(cmd + 9, "direct") != NULL;
+	}
+
+	else if (strncmp(cmd, "erase", 5) == 0) {
+		status = utp_erase(cmd + 5);
 		if (status)
 			flags = UTP_FLAG_STATUS;
 	}
 
+	else if (strncmp(cmd, "selftest", 8) == 0) {
+		data = utp_do_selftest(cmd[8] ? cmd + 9 : NULL, &size);
+		if (data) {
+			flags = UTP_FLAG_DATA;
+		} else {
+			flags = UTP_FLAG_STATUS;
+			status = -ENOMEM;
+		}
+	}
+
 	else {
 		printf("UTP: Unknown command received, ignored\n");
 		flags = UTP_FLAG_STATUS;
@@ -664,6 +1168,127 @@ static struct utp_message *utp_handle_command(int u, char *cmd, unsigned long lo
 	return w;
 }
 
+/*
+ * utp_executor
+ *
+ * worker thread running the asynchronous commands one after another
+ */
+static void *utp_executor(void *arg)
+{
+	int u = (int)(intptr_t)arg;
+	struct utp_message *answer;
+	struct utp_job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&utp_exec.lock);
+		while (!utp_exec.head)
+			pthread_cond_wait(&utp_exec.queued, &utp_exec.lock);
+		job = utp_exec.head;
+		utp_exec.head = job->next;
+		if (!utp_exec.head)
+			utp_exec.tail = NULL;
+		utp_exec.current = job;
+		utp_exec.started = time(NULL);
+		utp_exec.done = utp_exec.total = 0;
+		pthread_mutex_unlock(&utp_exec.lock);
+
+		answer = utp_handle_command(u, job->command, job->payload);
+		if (answer) {
+			utp_send_answer(u, answer, job->command);
+			free(answer);
+		}
+
+		pthread_mutex_lock(&utp_exec.lock);
+		utp_exec.current = NULL;
+		if (--utp_exec.pending == 0)
+			pthread_cond_broadcast(&utp_exec.idle);
+		pthread_mutex_unlock(&utp_exec.lock);
+		free(job);
+	}
+	return NULL;
+}
+
+/*
+ * utp_exec_queue
+ *
+ * report busy and hand the command over to the executor thread
+ */
+static int utp_exec_queue(int u, char *cmd, unsigned long long payload)
+{
+	struct utp_job *job;
+
+	job = malloc(sizeof(*job) + strlen(cmd) + 1);
+	if (!job)
+		return -ENOMEM;
+	job->next = NULL;
+	job->payload = payload;
+	strcpy(job->command, cmd);
+
+	utp_send_busy(u);
+
+	pthread_mutex_lock(&utp_exec.lock);
+	if (utp_exec.tail)
+		utp_exec.tail->next = job;
+	else
+		utp_exec.head = job;
+	utp_exec.tail = job;
+	utp_exec.pending++;
+	pthread_cond_signal(&utp_exec.queued);
+	pthread_mutex_unlock(&utp_exec.lock);
+	return 0;
+}
+
+/*
+ * utp_exec_wait_idle
+ *
+ * wait until every queued command has been answered
+ */
+static void utp_exec_wait_idle(void)
+{
+	pthread_mutex_lock(&utp_exec.lock);
+	while (utp_exec.pending)
+		pthread_cond_wait(&utp_exec.idle, &utp_exec.lock);
+	pthread_mutex_unlock(&utp_exec.lock);
+}
+
+/*
+ * utp_dispatch
+ *
+ * run the command inline or on the executor thread. Once a command is
+ * queued, everything but the immediate commands queues behind it so the
+ * host still sees the answers in order.
+ */
+static void utp_dispatch(int u, char *cmd, unsigned long long payload)
+{
+	struct utp_message *answer;
+	int flags = 0, pending;
+
+	if (cmd[0] == '&') {
+		flags |= UTP_CMD_ASYNC;
+		cmd++;
+	}
+	flags |= utp_cmd_flags(cmd);
+
+	if (!(flags & UTP_CMD_IMMEDIATE)) {
+		pthread_mutex_lock(&utp_exec.lock);
+		pending = utp_exec.pending;
+		pthread_mutex_unlock(&utp_exec.lock);
+
+		if ((pending || (flags & UTP_CMD_ASYNC)) &&
+		    utp_exec_queue(u, cmd, payload) == 0)
+			return;
+
+		/* could not queue it, run it inline once the executor is done */
+		utp_exec_wait_idle();
+	}
+
+	answer = utp_handle_command(u, cmd, payload);
+	if (answer) {
+		utp_send_answer(u, answer, cmd);
+		free(answer);
+	}
+}
+
 void feed_watchdog(void *arg)
 {
 	int res;
@@ -682,8 +1307,8 @@ int main(int argc, char **argv)
 	int u = -1, wdt_fd = -1, r, need_watchdog = 0;
 	int watchdog_timeout = 127;  /* sec */
 	int cpu_id = 50;
-	struct utp_message *uc, *answer;
-	pthread_t a_thread;
+	struct utp_message *uc;
+	pthread_t a_thread, exec_thread;
 	char * utp_devnode="/dev/utp";
 	if (argc > 1)
 		utp_devnode = argv[1];
@@ -691,10 +1316,13 @@ int main(int argc, char **argv)
 	printf("%s %s [built %s %s]\n", PACKAGE, VERSION, __DATE__, __TIME__);
 	/* set stdout unbuffered, what is the usage??? */
 //	setvbuf(stdout, NULL, _IONBF, 0);
-	uc = malloc(sizeof(*uc) + 0x10000);
+	uc = malloc(sizeof(*uc) + UTP_BUFSIZE);
 
 	mkdir("/tmp", 0777);
 
+	/* the kernel fixes the message size, only the rate is of interest */
+	tuner_init(&utp_sink, UTP_BUFSIZE, UTP_BUFSIZE, UTP_BUFSIZE);
+
 	setenv("FILE", UTP_TARGET_FILE, !0);
 
 	printf("UTP: Waiting for %s to appear\n", utp_devnode);
@@ -743,17 +1371,36 @@ int main(int argc, char **argv)
 		}
 	}
 
+	r = pthread_create(&exec_thread, NULL, utp_executor, (void *)(intptr_t)u);
+	if (r != 0) {
+		perror("Executor thread creation failed");
+		exit(EXIT_FAILURE);
+	}
+
 	for(;;) {
-		r = read(u, uc, sizeof(*uc) + 0x10000);
+		r = read(u, uc, sizeof(*uc) + UTP_BUFSIZE);
 		if (uc->flags & UTP_FLAG_COMMAND) {
-			answer = utp_handle_command(u, uc->command, uc->payload);
-			if (answer) {
-				printf("UTP: sending %s to kernel for command %s.\n", utp_answer_type(answer), uc->command);
-				write(u, answer, answer->size);
-				free(answer);
-			}
+			utp_dispatch(u, uc->command, uc->payload);
 		}else if (uc->flags & UTP_FLAG_DATA) {
-			write(utp_file, uc->data, uc->bufsize);
+			uint64_t start;
+			ssize_t w;
+			int err;
+
+			/* data belongs to the target of the last queued command */
+			utp_exec_wait_idle();
+			start = now_us();
+			if (utp_blk.managed && utp_blk.fd == utp_file) {
+				err = blk_sink_write(&utp_blk, uc->data, uc->bufsize, NULL);
+			} else {
+				w = write(utp_file, uc->data, uc->bufsize);
+				err = w < 0 ? -errno : w != uc->bufsize ? -EIO : 0;
+			}
+			/* reported by the save or flush that ends the transfer */
+			if (err && !utp_write_err) {
+				printf("UTP: write failed: %s\n", strerror(-err));
+				utp_write_err = err;
+			}
+			tuner_update(&utp_sink, uc->bufsize, now_us() - start);
 		}else {
 			printf("UTP: Unknown flag %x\n", uc->flags);
 		}